@@ -0,0 +1,367 @@
+#include "daemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Number of accepted connections waiting for a worker
+#define QUEUE_LEN 64
+
+// Connections waiting for a worker
+typedef struct conn_queue_t
+{
+  int fds[QUEUE_LEN];
+  size_t head;
+  size_t count;
+  bool closing; // no more connections will be queued
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+} ConnQueue;
+
+// State kept warm by a worker across requests
+typedef struct worker_t
+{
+  pthread_t thread;
+  ConnQueue *queue;
+  Workspace ws; // tables, and the decoding tree of the last codebook
+  Buffer *in;   // request payload
+  Buffer *out;  // reply payload
+} Worker;
+
+static volatile sig_atomic_t stopped = 0;
+
+/* ******************************************** */
+
+static void on_signal(int sig)
+{
+  (void)sig;
+  stopped = 1;
+}
+
+// Read exactly `len` octets, and fail on EOF
+static int read_full(int fd, void *data, uint64_t len)
+{
+  uint8_t *p = (uint8_t *)data;
+  while (len)
+  {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= (uint64_t)n;
+  }
+  return 0;
+}
+
+// Write exactly `len` octets
+static int write_full(int fd, const void *data, uint64_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  while (len)
+  {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= (uint64_t)n;
+  }
+  return 0;
+}
+
+// Grow the buffer to hold at least `capacity` octets, keeping its memory otherwise
+static int reserve(Buffer *buf, uint64_t capacity)
+{
+  if (capacity <= buf->capacity)
+    return 0;
+
+  uint8_t *mem = (uint8_t *)realloc(buf->buffer, capacity * sizeof(uint8_t));
+  if (mem_check(mem, "buf->buffer"))
+    return -1;
+
+  buf->buffer = mem;
+  buf->capacity = capacity;
+  return 0;
+}
+
+static int write_frame(int fd, uint8_t op, const uint8_t *data, uint64_t len)
+{
+  uint8_t head[1 + sizeof(uint64_t)];
+  head[0] = op;
+  memcpy(head + 1, &len, sizeof(uint64_t));
+
+  if (write_full(fd, head, sizeof(head)))
+    return -1;
+  return write_full(fd, data, len);
+}
+
+static int read_frame(int fd, uint8_t *op, Buffer *buf)
+{
+  uint8_t head[1 + sizeof(uint64_t)];
+  if (read_full(fd, head, sizeof(head)))
+    return -1;
+
+  *op = head[0];
+  memcpy(&buf->len, head + 1, sizeof(uint64_t));
+  if (buf->len > DAEMON_MAX_FRAME || reserve(buf, buf->len))
+    return -1;
+
+  return read_full(fd, buf->buffer, buf->len);
+}
+
+/* ******************************************** */
+
+// Run a request of the worker into `worker->out`
+static int serve_request(Worker *worker, uint8_t op)
+{
+  Buffer *in = worker->in;
+  Buffer *out = worker->out;
+
+  if (op == DAEMON_COMPRESS)
+  {
+    if (build_workspace(&worker->ws, in->buffer, in->len))
+      return -1;
+    if (reserve(out, encoded_size(&worker->ws)))
+      return -1;
+
+    out->len = encode_workspace(&worker->ws, in->buffer, in->len, out->buffer, out->capacity);
+    return out->len ? 0 : -1;
+  }
+
+  if (op == DAEMON_DECOMPRESS)
+  {
+    uint64_t len;
+    if (peek_length(in->buffer, in->len, &len) || len > DAEMON_MAX_FRAME || reserve(out, len))
+      return -1;
+    return decode_small(&worker->ws, in->buffer, in->len, out->buffer, out->capacity, &out->len);
+  }
+
+  return -1;
+}
+
+// Answer the requests of a connection until the client hangs up, or stays idle for too long
+static void serve_conn(Worker *worker, int fd)
+{
+  struct timeval idle = {.tv_sec = DAEMON_IDLE_SECS};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+
+  uint8_t op;
+  while (!read_frame(fd, &op, worker->in))
+  {
+    int failed = serve_request(worker, op);
+    if (failed)
+      worker->out->len = 0;
+
+    if (write_frame(fd, failed ? DAEMON_FAILED : DAEMON_OK, worker->out->buffer, worker->out->len))
+      break;
+  }
+  close(fd);
+}
+
+static void *worker_main(void *arg)
+{
+  Worker *worker = (Worker *)arg;
+  ConnQueue *queue = worker->queue;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->count && !queue->closing)
+      pthread_cond_wait(&queue->ready, &queue->lock);
+    if (!queue->count)
+    {
+      pthread_mutex_unlock(&queue->lock);
+      break;
+    }
+    int fd = queue->fds[queue->head];
+    queue->head = (queue->head + 1) % QUEUE_LEN;
+    queue->count--;
+    pthread_cond_broadcast(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+
+    serve_conn(worker, fd);
+  }
+  return NULL;
+}
+
+// Let the workers finish the queued connections, then join them and free their state
+static void stop_workers(ConnQueue *queue, Worker *workers, int num_started, int num_workers)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->closing = true;
+  pthread_cond_broadcast(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+
+  for (int i = 0; i < num_started; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  for (int i = 0; i < num_workers; i++)
+  {
+    del_buffer(workers[i].in);
+    del_buffer(workers[i].out);
+  }
+  free(workers);
+}
+
+// Remove a socket left by a previous daemon, and refuse to touch anything else at the path
+static int clear_socket(const char *path)
+{
+  struct stat st;
+  if (lstat(path, &st))
+    return (errno == ENOENT) ? 0 : -1;
+
+  if (!S_ISSOCK(st.st_mode))
+  {
+    fprintf(stderr, "[Error]\t'%s' exists and is not a socket\n", path);
+    return -1;
+  }
+  return unlink(path);
+}
+
+int run_daemon(const char *path, int num_workers)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "[Error]\tSocket path is too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  // Let the wait for connections return on the signals, and keep running when a client hangs up
+  struct sigaction act = {.sa_handler = on_signal};
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (clear_socket(path))
+    return -1;
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    return -1;
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, QUEUE_LEN) ||
+      fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK))
+  {
+    fprintf(stderr, "[Error]\tFailed to listen on '%s'\n", path);
+    close(sock);
+    return -1;
+  }
+
+  ConnQueue queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+  Worker *workers = (Worker *)calloc(num_workers, sizeof(Worker));
+  if (mem_check(workers, "workers"))
+  {
+    close(sock);
+    unlink(path);
+    return -1;
+  }
+
+  // The signals stay blocked but while the accepting thread waits for a connection, so that a signal arriving after
+  // the check of `stopped` interrupts the wait instead of going unnoticed until the next client
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+  int started = 0;
+  for (int i = 0; i < num_workers; i++)
+  {
+    workers[i].queue = &queue;
+    workers[i].ws.lut_bits = LUT_BITS;
+    workers[i].in = new_buffer(BUFSIZ);
+    workers[i].out = new_buffer(BUFSIZ);
+    if (mem_check(workers[i].in, "in") || mem_check(workers[i].out, "out") ||
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+      break;
+    started++;
+  }
+
+  if (started < num_workers)
+  {
+    fprintf(stderr, "[Error]\tFailed to start the workers\n");
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    stop_workers(&queue, workers, started, num_workers);
+    close(sock);
+    unlink(path);
+    return -1;
+  }
+
+  printf("[Info]\tListening on '%s' with %d workers\n", path, num_workers);
+  fflush(stdout);
+
+  while (!stopped)
+  {
+    fd_set waiting;
+    FD_ZERO(&waiting);
+    FD_SET(sock, &waiting);
+    if (pselect(sock + 1, &waiting, NULL, NULL, NULL, &old_mask) <= 0)
+      continue;
+
+    // The socket does not block, in case the client gave up in the meantime, but its connections do
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0)
+      continue;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == QUEUE_LEN)
+      pthread_cond_wait(&queue.ready, &queue.lock);
+    queue.fds[(queue.head + queue.count) % QUEUE_LEN] = fd;
+    queue.count++;
+    pthread_cond_broadcast(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+  }
+
+  printf("[Info]\tShutting down\n");
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  close(sock);
+  unlink(path);
+  stop_workers(&queue, workers, started, num_workers);
+  pthread_mutex_destroy(&queue.lock);
+  pthread_cond_destroy(&queue.ready);
+  return 0;
+}
+
+/* ******************************************** */
+
+int daemon_connect(const char *path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+  {
+    fprintf(stderr, "[Error]\tFailed to connect to '%s'\n", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int daemon_request(int fd, uint8_t op, const uint8_t *data, uint64_t len, Buffer *out)
+{
+  uint8_t status;
+
+  if (write_frame(fd, op, data, len) || read_frame(fd, &status, out))
+    return -1;
+  return (status == DAEMON_OK) ? 0 : -1;
+}
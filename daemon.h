@@ -0,0 +1,42 @@
+#pragma once
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include "huffman.h"
+
+// Operations of a request frame
+#define DAEMON_COMPRESS 'C'
+#define DAEMON_DECOMPRESS 'D'
+
+// Status of a reply frame
+#define DAEMON_OK 0x00
+#define DAEMON_FAILED 0x01
+
+// Number of workers serving the connections
+#define DAEMON_WORKERS 4
+
+// Seconds a connection may stay silent before it is dropped
+#define DAEMON_IDLE_SECS 30
+
+// Largest payload accepted in a frame
+#define DAEMON_MAX_FRAME ((uint64_t)64 << 20)
+
+/*
+ * Every frame is an operation (or a status in replies) of 1 octet,
+ * followed by the payload length of 8 octets and the payload itself.
+ * A connection may carry any number of requests, answered in order,
+ * and is closed once it stays idle for DAEMON_IDLE_SECS.
+ */
+
+/* ******************************************** */
+
+// Serve compress/decompress requests on the unix domain socket until interrupted
+int run_daemon(const char *path, int num_workers);
+
+// Connect to a running daemon, and return the socket descriptor
+int daemon_connect(const char *path);
+
+// Send a request, and receive the reply payload into `out`
+int daemon_request(int fd, uint8_t op, const uint8_t *data, uint64_t len, Buffer *out);
+
+#endif // __DAEMON_H__
@@ -1,4 +1,10 @@
 #include "huffman.h"
+#include "transform.h"
+#include "wide.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 
 // #define __DEBUG__
 
@@ -19,19 +25,66 @@ int mem_check(void *ptr, const char *name)
 
 uint8_t *bitstr(unsigned num, uint8_t len)
 {
-  uint8_t *str = (uint8_t *)malloc(len * sizeof(uint8_t));
+  uint8_t *str = (uint8_t *)malloc((len + 1) * sizeof(uint8_t));
   if (mem_check(str, "str"))
     return NULL;
 
   for (uint8_t i = 0; i < len; i++)
     str[len - i - 1] = (num & (1 << i)) ? '1' : '0';
+  str[len] = '\0';
   return str;
 }
 
 /* ************************************************** */
 
-// Allocate a new buffer
-Buffer *new_buffer(uint64_t capacity);
+static void *pool_main(void *arg)
+{
+  PoolThread *thread = (PoolThread *)arg;
+  thread->task(thread->arg, thread->id);
+  return NULL;
+}
+
+int start_pool(ThreadPool *pool, PoolTask task, void *arg, int first, int num_threads)
+{
+  pool->num_started = 0;
+  pool->threads = (num_threads > 0) ? (PoolThread *)calloc(num_threads, sizeof(PoolThread)) : NULL;
+  if (!pool->threads)
+    return 0;
+
+  for (int i = 0; i < num_threads; i++)
+  {
+    PoolThread *thread = &pool->threads[i];
+    thread->task = task;
+    thread->arg = arg;
+    thread->id = first + i;
+    if (pthread_create(&thread->thread, NULL, pool_main, thread))
+      break;
+    pool->num_started++;
+  }
+  return pool->num_started;
+}
+
+void join_pool(ThreadPool *pool)
+{
+  for (int i = 0; i < pool->num_started; i++)
+    pthread_join(pool->threads[i].thread, NULL);
+  free(pool->threads);
+  pool->threads = NULL;
+  pool->num_started = 0;
+}
+
+void run_pool(PoolTask task, void *arg, int num_threads)
+{
+  ThreadPool pool;
+  int started = start_pool(&pool, task, arg, 1, num_threads - 1);
+
+  task(arg, 0);
+  for (int id = 1 + started; id < num_threads; id++)
+    task(arg, id);
+  join_pool(&pool);
+}
+
+/* ************************************************** */
 
 // Add a byte to the buffer
 Buffer *add_buffer(Buffer *buf, uint8_t byte);
@@ -204,7 +257,7 @@ Node *add_node(Node *root, Node *node)
 uint8_t *init_symbol_list(Buffer *buf, size_t *counter)
 {
   uint8_t *list;
-  size_t count = *counter;
+  size_t count = 0;
 
   list = (uint8_t *)malloc(buf->len * sizeof(uint8_t));
   if (mem_check(list, "symbols"))
@@ -213,7 +266,7 @@ uint8_t *init_symbol_list(Buffer *buf, size_t *counter)
   for (size_t i = 0; i < buf->len; i++)
   {
     uint8_t c = buf->buffer[i];
-    if (count == 0 || c != list[count - 1])
+    if (!memchr(list, c, count))
       list[count++] = c;
   }
 
@@ -359,11 +412,13 @@ void dfs(CodeBook *book, Node *node, uint32_t code, uint8_t len)
 
 void print_table(CodeTable *table)
 {
+  uint8_t *str = bitstr(table->code, table->num_bits);
   printf("[Info]\tCodeTable(");
   printf("symbol=%#x, ", table->symbol);
-  printf("code=%s, ", bitstr(table->code, table->num_bits));
+  printf("code=%s, ", str);
   printf("num_bits=%u", table->num_bits);
   printf(")\n");
+  free(str);
 }
 
 CodeBook *new_codebook()
@@ -408,7 +463,7 @@ CodeBook *tree2book(Tree *tree)
 
 CodeTable *search_symbol(CodeBook *book, uint8_t symbol)
 {
-  for (uint8_t i = 0; i < book->num_symbols; i++)
+  for (size_t i = 0; i < book->num_symbols; i++)
     if (book->table[i]->symbol == symbol)
       return book->table[i];
   return NULL;
@@ -417,7 +472,7 @@ CodeTable *search_symbol(CodeBook *book, uint8_t symbol)
 CodeTable *search_code(CodeBook *book, uint32_t code, uint8_t len)
 {
   // printf("[Info]\tSearching code: %s\n", bitstr(code, len));
-  for (uint8_t i = 0; i < book->num_symbols; i++)
+  for (size_t i = 0; i < book->num_symbols; i++)
     if (book->table[i]->code == code && book->table[i]->num_bits == len)
       return book->table[i];
   return NULL;
@@ -425,31 +480,148 @@ CodeTable *search_code(CodeBook *book, uint32_t code, uint8_t len)
 
 /* ******************************************* */
 
-void write_bit(uint8_t bit, FILE *fp)
+void init_encoder(HuffEncoder *enc, FILE *fp, CodeBook *book)
 {
-  static uint8_t byte = 0x00;
-  static uint8_t bit_idx = 8;
+  enc->fp = fp;
+  enc->byte = 0x00;
+  enc->bit_idx = 8;
+  enc->num_bits = 0;
+
+  // Keep the first code of each symbol, as `search_symbol()` does
+  memset(enc->table, 0, sizeof(enc->table));
+  for (size_t i = 0; i < book->num_symbols; i++)
+    if (!enc->table[book->table[i]->symbol].num_bits)
+      enc->table[book->table[i]->symbol] = *book->table[i];
+}
 
-  byte |= (bit << --bit_idx);
-  if (bit_idx == 0)
+void write_bit(HuffEncoder *enc, uint8_t bit)
+{
+  enc->byte |= (bit << --enc->bit_idx);
+  enc->num_bits++;
+  if (enc->bit_idx == 0)
   {
-    printf("[Info]\tWriting byte: %s\n", bitstr(byte, 8));
-    fwrite(&byte, sizeof(uint8_t), 1, fp);
-    byte = 0x00;
-    bit_idx = 8;
+#if defined(__DEBUG__)
+    uint8_t *str = bitstr(enc->byte, 8);
+    printf("[DEBUG]\tWriting byte: %s\n", str);
+    free(str);
+#endif // __DEBUG__
+    fwrite(&enc->byte, sizeof(uint8_t), 1, enc->fp);
+    enc->byte = 0x00;
+    enc->bit_idx = 8;
   }
 }
 
-void write_code(CodeTable *table, FILE *fp)
+void write_code(HuffEncoder *enc, CodeTable *table)
 {
   uint8_t bit;
   for (uint8_t i = 0; i < table->num_bits; i++)
   {
     bit = (table->code >> (table->num_bits - i - 1)) & 0x01;
-    write_bit(bit, fp);
+    write_bit(enc, bit);
+  }
+}
+
+int encode_symbol(HuffEncoder *enc, uint8_t symbol)
+{
+  CodeTable *table = &enc->table[symbol];
+  if (!table->num_bits)
+    return -1;
+
+  write_code(enc, table);
+  return 0;
+}
+
+void flush_encoder(HuffEncoder *enc)
+{
+  // Pad the last partial octet with zeros
+  if (enc->bit_idx != 8)
+  {
+    fwrite(&enc->byte, sizeof(uint8_t), 1, enc->fp);
+    enc->byte = 0x00;
+    enc->bit_idx = 8;
+  }
+}
+
+/* ******************************************* */
+
+int init_decoder(HuffDecoder *dec, FILE *fp, CodeBook *book)
+{
+  dec->fp = fp;
+  dec->byte = 0x00;
+  dec->bit_idx = 0;
+
+  // A tree of n leaves has 2n - 1 nodes
+  dec->nodes = (Node *)calloc(2 * book->num_symbols + 1, sizeof(Node));
+  if (mem_check(dec->nodes, "dec->nodes"))
+    return -1;
+  dec->num_nodes = 1;
+
+  for (size_t i = 0; i < book->num_symbols; i++)
+  {
+    CodeTable *table = book->table[i];
+    Node *node = &dec->nodes[0];
+
+    // Walk down the tree, adding the missing nodes
+    for (uint8_t k = table->num_bits; k > 0; k--)
+    {
+      uint8_t bit = (table->code >> (k - 1)) & 0x01;
+      if (node->is_leaf || (!node->children[bit] && dec->num_nodes == 2 * book->num_symbols + 1))
+        goto invalid;
+      if (!node->children[bit])
+        node->children[bit] = &dec->nodes[dec->num_nodes++];
+      node = node->children[bit];
+    }
+
+    // Codes must not be prefixes of each other
+    if (node == &dec->nodes[0] || node->is_leaf || node->children[0] || node->children[1])
+      goto invalid;
+    node->is_leaf = true;
+    node->symbol = table->symbol;
+  }
+  return 0;
+
+invalid:
+  fprintf(stderr, "[Error]\tInvalid codebook\n");
+  free(dec->nodes);
+  dec->nodes = NULL;
+  return -1;
+}
+
+int read_bit(HuffDecoder *dec)
+{
+  if (dec->bit_idx == 0)
+  {
+    if (fread(&dec->byte, sizeof(uint8_t), 1, dec->fp) != 1)
+      return -1;
+    dec->bit_idx = 8;
+  }
+  return (dec->byte >> --dec->bit_idx) & 0x01;
+}
+
+int decode_symbol(HuffDecoder *dec, uint8_t *symbol)
+{
+  Node *node = &dec->nodes[0];
+  while (!node->is_leaf)
+  {
+    int bit = read_bit(dec);
+    if (bit < 0 || !(node = node->children[bit]))
+      return -1;
   }
+
+  *symbol = node->symbol;
+  return 0;
+}
+
+void finish_decoder(HuffDecoder *dec)
+{
+  // The padding bits of the last octet are dropped
+  dec->bit_idx = 0;
+  free(dec->nodes);
+  dec->nodes = NULL;
 }
 
+/* ******************************************* */
+
 void compress(FILE *fp, Buffer *buf, CodeBook *book)
 {
   const char sep = GROUP_SEPARATOR; // GS (Group Separator)
@@ -478,16 +650,12 @@ void compress(FILE *fp, Buffer *buf, CodeBook *book)
   fwrite(&sep, sizeof(uint8_t), 1, fp); // End of header
 
   // Write the compressed data as a bitsream
-  uint64_t count = 0;
+  HuffEncoder enc;
+  init_encoder(&enc, fp, book);
   for (size_t i = 0; i < buf->len; i++)
-  {
-    CodeTable *table = search_symbol(book, buf->buffer[i]);
-    if (table)
-    {
-      count += table->num_bits;
-      write_code(table, fp);
-    }
-  }
+    encode_symbol(&enc, buf->buffer[i]);
+  flush_encoder(&enc);
+  uint64_t count = enc.num_bits;
 
   // Write the separator
   fwrite(&sep, sizeof(uint8_t), 1, fp); // End of data
@@ -546,6 +714,1959 @@ CodeBook *read_codebook(FILE *fp)
 
 /* ******************************************** */
 
+// Order the leaves by the frequency, then by the symbol
+static int cmp_leaves(const void *a, const void *b)
+{
+  const CodeLeaf *x = (const CodeLeaf *)a, *y = (const CodeLeaf *)b;
+  if (x->freqs != y->freqs)
+    return (x->freqs > y->freqs) - (x->freqs < y->freqs);
+  return (x->symbol > y->symbol) - (x->symbol < y->symbol);
+}
+
+static void sort_leaves(CodeLeaf *leaves, uint32_t num)
+{
+  // Octet alphabets are sorted in place, as `qsort()` may allocate and the short-message encoder must not
+  if (num > 256)
+  {
+    qsort(leaves, num, sizeof(CodeLeaf), cmp_leaves);
+    return;
+  }
+
+  for (uint32_t i = 1; i < num; i++)
+  {
+    CodeLeaf leaf = leaves[i];
+    uint32_t j = i;
+    for (; j > 0 && cmp_leaves(&leaves[j - 1], &leaf) > 0; j--)
+      leaves[j] = leaves[j - 1];
+    leaves[j] = leaf;
+  }
+}
+
+// Depths of the leaves in the tree of the two-queue method over the sorted `leaves`; returns the deepest
+static uint32_t tree_depths(const CodeLeaf *leaves, uint32_t num, uint8_t *lens, size_t *weights, uint32_t *parents)
+{
+  // Internal nodes are created in order of the weight, after the leaves, so both queues stay sorted
+  uint32_t li = 0, ii = num;
+  for (uint32_t ni = num; ni < 2 * num - 1; ni++)
+  {
+    weights[ni] = 0;
+    for (int c = 0; c < 2; c++)
+    {
+      uint32_t child;
+      if (li < num && (ii == ni || leaves[li].freqs <= weights[ii]))
+      {
+        child = li;
+        weights[ni] += leaves[li++].freqs;
+      }
+      else
+      {
+        child = ii;
+        weights[ni] += weights[ii++];
+      }
+      parents[child] = ni;
+    }
+  }
+
+  // Depths from the root down, as every parent comes after its children
+  uint32_t deepest = 0;
+  weights[2 * num - 2] = 0;
+  for (uint32_t k = 2 * num - 2; k-- > 0;)
+  {
+    weights[k] = weights[parents[k]] + 1;
+    if (k < num)
+    {
+      lens[leaves[k].symbol] = (uint8_t)((weights[k] > MAX_CODE_BITS) ? MAX_CODE_BITS + 1 : weights[k]);
+      if (weights[k] > deepest)
+        deepest = (uint32_t)weights[k];
+    }
+  }
+  return deepest;
+}
+
+uint32_t code_lengths(const size_t *freqs, uint32_t num_symbols, uint8_t *lens, CodeLeaf *leaves, size_t *weights,
+                      uint32_t *parents)
+{
+  uint32_t num = 0;
+  memset(lens, 0, num_symbols * sizeof(uint8_t));
+  for (uint32_t s = 0; s < num_symbols; s++)
+    if (freqs[s])
+      leaves[num++] = (CodeLeaf){.freqs = freqs[s], .symbol = s};
+
+  // A lone symbol still needs one bit
+  if (num == 1)
+    lens[leaves[0].symbol] = 1;
+
+  // Flatten the statistics until the longest code fits
+  while (num > 1)
+  {
+    sort_leaves(leaves, num);
+    if (tree_depths(leaves, num, lens, weights, parents) <= MAX_CODE_BITS)
+      break;
+    for (uint32_t k = 0; k < num; k++)
+      leaves[k].freqs = (leaves[k].freqs >> 1) | 1;
+  }
+  return num;
+}
+
+int canonical_codes(const uint8_t *lens, uint32_t num_symbols, uint32_t *codes, uint32_t *count, uint64_t *first)
+{
+  uint64_t next[MAX_CODE_BITS + 1];
+
+  memset(count, 0, (MAX_CODE_BITS + 1) * sizeof(uint32_t));
+  for (uint32_t s = 0; s < num_symbols; s++)
+  {
+    if (lens[s] > MAX_CODE_BITS)
+      return -1;
+    if (lens[s])
+      count[lens[s]]++;
+  }
+
+  // Codes of each length follow the prefixes of the shorter ones
+  uint64_t code = 0;
+  for (uint8_t k = 1; k <= MAX_CODE_BITS; k++)
+  {
+    code = (code + count[k - 1]) << 1;
+    if (code + count[k] > ((uint64_t)1 << k))
+      return -1;
+    first[k] = next[k] = code;
+  }
+
+  for (uint32_t s = 0; s < num_symbols; s++)
+    if (lens[s])
+      codes[s] = (uint32_t)next[lens[s]]++;
+  return 0;
+}
+
+void count_symbols(size_t *freqs, const uint8_t *msg, uint64_t len)
+{
+  // Short messages do not pay for clearing and summing the interleaved tables
+  if (len < COUNT_INTERLEAVE_MIN)
+  {
+    memset(freqs, 0, 256 * sizeof(size_t));
+    for (uint64_t i = 0; i < len; i++)
+      freqs[msg[i]]++;
+    return;
+  }
+
+  // Interleave four tables, so that runs of a symbol do not wait on the same counter
+  size_t counts[4][256] = {{0}};
+  uint64_t i = 0;
+
+  for (; i + 4 <= len; i += 4)
+  {
+    counts[0][msg[i]]++;
+    counts[1][msg[i + 1]]++;
+    counts[2][msg[i + 2]]++;
+    counts[3][msg[i + 3]]++;
+  }
+  for (; i < len; i++)
+    counts[0][msg[i]]++;
+
+  for (unsigned s = 0; s < 256; s++)
+    freqs[s] = counts[0][s] + counts[1][s] + counts[2][s] + counts[3][s];
+}
+
+int build_workspace(Workspace *ws, const uint8_t *msg, uint64_t len)
+{
+  CodeLeaf leaves[256];
+  size_t weights[2 * 256];
+  uint32_t parents[2 * 256];
+  uint8_t lens[256];
+  uint32_t codes[256], count[MAX_CODE_BITS + 1];
+  uint64_t first[MAX_CODE_BITS + 1];
+
+  count_symbols(ws->freqs, msg, len);
+  ws->num_symbols = code_lengths(ws->freqs, 256, lens, leaves, weights, parents);
+  if (canonical_codes(lens, 256, codes, count, first))
+    return -1;
+
+  memset(ws->table, 0, sizeof(ws->table));
+  ws->total_bits = 0;
+  for (unsigned s = 0; s < 256; s++)
+  {
+    if (!lens[s])
+      continue;
+    ws->table[s] = (CodeTable){.symbol = (uint8_t)s, .code = codes[s], .num_bits = lens[s]};
+    ws->total_bits += ws->freqs[s] * lens[s];
+  }
+  return 0;
+}
+
+// Size of the codebook section of a table indexed by the symbol
+static uint64_t book_size(CodeTable *table)
+{
+  uint64_t size = sizeof(uint64_t);
+  for (unsigned s = 0; s < 256; s++)
+    if (table[s].num_bits)
+      size += 2 + (table[s].num_bits + 7) / 8;
+  return size;
+}
+
+// Write the codebook section (number of symbols, then symbol, bits and code of each) of a table
+static uint8_t *write_book(CodeTable *table, uint8_t *p)
+{
+  uint64_t num_symbols = 0;
+  for (unsigned s = 0; s < 256; s++)
+    if (table[s].num_bits)
+      num_symbols++;
+
+  memcpy(p, &num_symbols, sizeof(uint64_t));
+  p += sizeof(uint64_t);
+
+  for (unsigned s = 0; s < 256; s++)
+  {
+    CodeTable *tb = &table[s];
+    if (!tb->num_bits)
+      continue;
+
+    *p++ = tb->symbol;
+    *p++ = tb->num_bits;
+    for (uint8_t b = 0; b < (tb->num_bits + 7) / 8; b++)
+      *p++ = (uint8_t)(tb->code >> (8 * b));
+  }
+  return p;
+}
+
+// Length of the codebook section at `book` (0 if malformed)
+static uint64_t check_book(const uint8_t *book, uint64_t size)
+{
+  uint64_t num_symbols;
+  uint64_t pos = sizeof(uint64_t);
+
+  if (size < pos)
+    return 0;
+  memcpy(&num_symbols, book, sizeof(uint64_t));
+  if (num_symbols > 256)
+    return 0;
+
+  for (uint64_t i = 0; i < num_symbols; i++)
+  {
+    if (pos + 2 > size || book[pos + 1] == 0 || book[pos + 1] > MAX_CODE_BITS)
+      return 0;
+    pos += 2 + (book[pos + 1] + 7) / 8;
+  }
+  return (pos <= size) ? pos : 0;
+}
+
+// Fill a table indexed by the symbol from a codebook section
+static void load_table(CodeTable *table, const uint8_t *book)
+{
+  uint64_t num_symbols;
+  uint64_t pos = sizeof(uint64_t);
+
+  memset(table, 0, 256 * sizeof(CodeTable));
+  memcpy(&num_symbols, book, sizeof(uint64_t));
+  for (uint64_t i = 0; i < num_symbols; i++)
+  {
+    CodeTable *tb = &table[book[pos]];
+    tb->symbol = book[pos];
+    tb->num_bits = book[pos + 1];
+    tb->code = 0;
+    for (uint8_t b = 0; b < (tb->num_bits + 7) / 8; b++)
+      tb->code |= (uint32_t)book[pos + 2 + b] << (8 * b);
+    pos += 2 + (tb->num_bits + 7) / 8;
+  }
+}
+
+// Pack the codes of a message, and flush the last partial octet
+static uint8_t *pack_bits(CodeTable *table, const uint8_t *msg, uint64_t len, uint8_t *p)
+{
+  BitPacker bp = {.p = p};
+  for (uint64_t i = 0; i < len; i++)
+    put_code(&bp, table[msg[i]].code, table[msg[i]].num_bits);
+  return flush_codes(&bp);
+}
+
+uint64_t encoded_size(Workspace *ws)
+{
+  // Signature, codebook, separator, original length, separator
+  uint64_t size = FILE_SIGN_LEN + book_size(ws->table) + 1 + sizeof(uint64_t) + 1;
+
+  // Bitstream, separator, number of bits
+  size += (ws->total_bits + 7) / 8 + 1 + sizeof(uint64_t);
+  return size;
+}
+
+uint64_t encode_workspace(Workspace *ws, const uint8_t *msg, uint64_t len, uint8_t *out, uint64_t capacity)
+{
+  uint8_t *p = out;
+
+  if (encoded_size(ws) > capacity)
+    return 0;
+
+  // Same layout as `compress()`
+  memcpy(p, FILE_SIGN, FILE_SIGN_LEN);
+  p += FILE_SIGN_LEN;
+  p = write_book(ws->table, p);
+
+  *p++ = GROUP_SEPARATOR; // End of codebook
+  memcpy(p, &len, sizeof(uint64_t));
+  p += sizeof(uint64_t);
+  *p++ = GROUP_SEPARATOR; // End of header
+
+  p = pack_bits(ws->table, msg, len, p);
+
+  *p++ = GROUP_SEPARATOR; // End of data
+  memcpy(p, &ws->total_bits, sizeof(uint64_t));
+  p += sizeof(uint64_t);
+
+  return (uint64_t)(p - out);
+}
+
+uint64_t encode_small(Workspace *ws, const uint8_t *msg, uint64_t len, uint8_t *out, uint64_t capacity)
+{
+  if (build_workspace(ws, msg, len))
+    return 0;
+  return encode_workspace(ws, msg, len, out, capacity);
+}
+
+// Locate the codebook and the bitstream of an encoded stream; returns the offset of the bitstream (0 if invalid)
+static uint64_t parse_stream(const uint8_t *in, uint64_t size, uint64_t *book_end, uint64_t *len)
+{
+  // Signature, separators and both lengths
+  if (size < FILE_SIGN_LEN + 3 * sizeof(uint64_t) + 3 || memcmp(in, FILE_SIGN, FILE_SIGN_LEN))
+    return 0;
+
+  uint64_t book_len = check_book(in + FILE_SIGN_LEN, size - FILE_SIGN_LEN);
+  if (!book_len)
+    return 0;
+
+  uint64_t pos = FILE_SIGN_LEN + book_len;
+  *book_end = pos;
+  if (pos + sizeof(uint64_t) + 2 + 1 + sizeof(uint64_t) > size || in[pos] != GROUP_SEPARATOR)
+    return 0;
+
+  memcpy(len, in + pos + 1, sizeof(uint64_t));
+  pos += 1 + sizeof(uint64_t);
+  if (in[pos] != GROUP_SEPARATOR || in[size - sizeof(uint64_t) - 1] != GROUP_SEPARATOR)
+    return 0;
+
+  return pos + 1;
+}
+
+int peek_length(const uint8_t *in, uint64_t size, uint64_t *len)
+{
+  uint64_t book_end;
+  return parse_stream(in, size, &book_end, len) ? 0 : -1;
+}
+
+// Rebuild the decoding tree of `ws->nodes` from the codebook section
+static int load_tree(Workspace *ws, const uint8_t *book, uint64_t book_len)
+{
+  CodeTable *table = ws->table;
+  size_t used = 1;
+
+  load_table(table, book);
+  memset(ws->nodes, 0, sizeof(ws->nodes));
+  ws->root = &ws->nodes[0];
+  ws->num_symbols = 0;
+
+  for (unsigned s = 0; s < 256; s++)
+  {
+    if (!table[s].num_bits)
+      continue;
+
+    // Walk down the tree, adding the missing nodes
+    Node *node = ws->root;
+    for (uint8_t k = table[s].num_bits; k > 0; k--)
+    {
+      if (node->is_leaf)
+        return -1;
+
+      uint8_t bit = (table[s].code >> (k - 1)) & 0x01;
+      if (!node->children[bit])
+      {
+        if (used == sizeof(ws->nodes) / sizeof(Node))
+          return -1;
+        node->children[bit] = &ws->nodes[used++];
+      }
+      node = node->children[bit];
+    }
+
+    // Codes must not be prefixes of each other
+    if (node->is_leaf || node->children[0] || node->children[1])
+      return -1;
+    node->is_leaf = true;
+    node->symbol = (uint8_t)s;
+    ws->num_symbols++;
+  }
+
+  memcpy(ws->book, book, book_len);
+  ws->book_len = book_len;
+  return 0;
+}
+
+// Fill the entries of the lookup table, `bits` wide, that start with the code `prefix` of `node` (`depth` bits long)
+static void fill_lut(Workspace *ws, Node *node, uint32_t prefix, uint8_t depth, uint8_t bits)
+{
+  LutEntry entry = {.next = LUT_INVALID, .symbol = 0, .num_bits = 0};
+
+  if (node && !node->is_leaf && depth < bits)
+  {
+    fill_lut(ws, node->children[0], prefix << 1, depth + 1, bits);
+    fill_lut(ws, node->children[1], (prefix << 1) | 0x01, depth + 1, bits);
+    return;
+  }
+
+  // Short codes fill every entry that starts with them, longer ones continue from their node in the tree
+  if (node && node->is_leaf)
+  {
+    entry.symbol = node->symbol;
+    entry.num_bits = depth;
+  }
+  else if (node)
+    entry.next = (uint16_t)(node - ws->nodes);
+
+  LutEntry *from = &ws->lut[prefix << (bits - depth)];
+  for (uint32_t v = 0; v < ((uint32_t)1 << (bits - depth)); v++)
+    from[v] = entry;
+}
+
+// Fill the lookup table of the decoding tree, `bits` wide
+static void build_lut(Workspace *ws, uint8_t bits)
+{
+  fill_lut(ws, ws->root, 0, 0, bits);
+  ws->lut_built = bits;
+}
+
+// Load the decoding tree of a codebook section, unless the workspace already holds it, with a lookup table as wide as
+// decoding `len` symbols pays for
+static int use_book(Workspace *ws, const uint8_t *book, uint64_t book_len, uint64_t len)
+{
+  if (ws->lut_bits > LUT_MAX_BITS)
+    ws->lut_bits = LUT_MAX_BITS;
+
+  if (ws->book_len != book_len || memcmp(ws->book, book, book_len))
+  {
+    if (load_tree(ws, book, book_len))
+    {
+      ws->book_len = 0;
+      return -1;
+    }
+    ws->lut_built = 0;
+  }
+
+  // No wider than the number of symbols, so that filling it does not cost more than the tree walks it saves
+  uint8_t bits = ws->lut_bits;
+  while (bits && ((uint64_t)1 << bits) > len)
+    bits--;
+  if (bits >= LUT_MIN_BITS && bits > ws->lut_built)
+    build_lut(ws, bits);
+  return 0;
+}
+
+// Reader of a bitstream from any bit, holding the next bits in an accumulator
+typedef struct bit_cursor_t
+{
+  const uint8_t *data;
+  uint64_t num_bytes; // length of the bitstream, padding included
+  uint64_t next;      // next octet to load into `acc`
+  uint64_t acc;       // bits the next code starts with, the first one highest
+  unsigned have;      // number of bits in `acc`
+} BitCursor;
+
+static inline void load_bits(BitCursor *cur)
+{
+  while (cur->have <= 56 && cur->next < cur->num_bytes)
+  {
+    cur->acc |= (uint64_t)cur->data[cur->next++] << (56 - cur->have);
+    cur->have += 8;
+  }
+}
+
+// Place the cursor on bit `pos` of a bitstream, whose padding decodes like any other bits
+static void seek_bits(BitCursor *cur, const uint8_t *data, uint64_t num_bits, uint64_t pos)
+{
+  cur->data = data;
+  cur->num_bytes = (num_bits + 7) >> 3;
+  cur->next = pos >> 3;
+  cur->acc = 0;
+  cur->have = 0;
+  load_bits(cur);
+  cur->acc <<= pos & 0x07;
+  cur->have -= pos & 0x07;
+}
+
+// Bit the next code starts at
+static inline uint64_t cursor_pos(BitCursor *cur)
+{
+  return (cur->next << 3) - cur->have;
+}
+
+// Decode the code at the cursor, `ws->lut_built` bits at a time through the lookup table and bit by bit down the tree
+// past it, and move the cursor after it (false if the bits are not a code)
+static inline bool next_code(Workspace *ws, BitCursor *cur, uint8_t *symbol)
+{
+  uint8_t bits = ws->lut_built;
+  Node *node = ws->root;
+  unsigned used = 0;
+
+  load_bits(cur);
+  if (bits)
+  {
+    LutEntry entry = ws->lut[cur->acc >> (64 - bits)];
+    if (entry.num_bits && entry.num_bits <= cur->have)
+    {
+      *symbol = entry.symbol;
+      cur->acc <<= entry.num_bits;
+      cur->have -= entry.num_bits;
+      return true;
+    }
+    if (entry.num_bits || entry.next == LUT_INVALID)
+      return false;
+    node = &ws->nodes[entry.next];
+    used = bits;
+  }
+
+  while (!node->is_leaf)
+  {
+    if (used >= cur->have)
+      return false;
+    node = node->children[(cur->acc >> (63 - used++)) & 0x01];
+    if (!node)
+      return false;
+  }
+  *symbol = node->symbol;
+  cur->acc = (used < 64) ? cur->acc << used : 0;
+  cur->have -= used;
+  return true;
+}
+
+// Decode until `len` symbols are out, and return the number of symbols decoded
+static uint64_t unpack_bits(Workspace *ws, const uint8_t *data, uint64_t data_len, uint8_t *out, uint64_t len)
+{
+  BitCursor cur;
+  uint64_t count = 0;
+
+  seek_bits(&cur, data, 8 * data_len, 0);
+  while (count < len && next_code(ws, &cur, &out[count]))
+    count++;
+  return count;
+}
+
+int decode_small(Workspace *ws, const uint8_t *in, uint64_t size, uint8_t *out, uint64_t capacity, uint64_t *len)
+{
+  uint64_t book_end;
+  uint64_t pos = parse_stream(in, size, &book_end, len);
+  if (!pos || *len > capacity)
+    return -1;
+
+  // Reuse the tree of the previous stream if it was encoded with the same codebook
+  if (use_book(ws, in + FILE_SIGN_LEN, book_end - FILE_SIGN_LEN, *len))
+    return -1;
+
+  uint64_t data_len = size - sizeof(uint64_t) - 1 - pos;
+  return (unpack_bits(ws, in + pos, data_len, out, *len) == *len) ? 0 : -1;
+}
+
+// Part of the bitstream decoded by one thread, from a bit that may be inside a code
+typedef struct spec_chunk_t
+{
+  Workspace *ws;
+  const uint8_t *data;
+  uint64_t num_bits; // length of the whole bitstream
+  uint64_t start;    // first bit of the chunk, a multiple of 64
+  uint64_t stop;     // first bit of the next chunk
+  uint64_t end;      // bit after the last symbol decoded
+  uint64_t *marks;   // bitmap of the bits a decoded symbol starts at, shared by the chunks
+  uint8_t *out;      // decoded symbols
+  uint64_t capacity; // room in `out`
+  uint64_t count;    // number of decoded symbols
+} SpecChunk;
+
+// Decode the symbols starting inside chunk `id`, marking where each one starts
+static void spec_worker(void *arg, int id)
+{
+  SpecChunk *chunk = &((SpecChunk *)arg)[id];
+  BitCursor cur;
+
+  seek_bits(&cur, chunk->data, chunk->num_bits, chunk->start);
+  chunk->count = 0;
+  for (uint64_t pos = chunk->start; pos < chunk->stop && chunk->count < chunk->capacity; pos = cursor_pos(&cur))
+  {
+    if (!next_code(chunk->ws, &cur, &chunk->out[chunk->count]))
+      break;
+    chunk->marks[pos >> 6] |= (uint64_t)1 << (pos & 63);
+    chunk->count++;
+  }
+  chunk->end = cursor_pos(&cur);
+}
+
+// Number of symbols the chunk decoded before bit `pos`
+static uint64_t spec_rank(SpecChunk *chunk, uint64_t pos)
+{
+  uint64_t count = 0;
+  for (uint64_t w = chunk->start >> 6; w < pos >> 6; w++)
+    count += __builtin_popcountll(chunk->marks[w]);
+  if (pos & 63)
+    count += __builtin_popcountll(chunk->marks[pos >> 6] & (((uint64_t)1 << (pos & 63)) - 1));
+  return count;
+}
+
+int decode_speculative(Workspace *ws, const uint8_t *in, uint64_t size, uint8_t *out, uint64_t capacity, uint64_t *len,
+                       int num_threads)
+{
+  uint64_t book_end;
+  uint64_t offset = parse_stream(in, size, &book_end, len);
+  if (!offset || *len > capacity)
+    return -1;
+  if (use_book(ws, in + FILE_SIGN_LEN, book_end - FILE_SIGN_LEN, *len))
+    return -1;
+
+  // Trust the number of bits only as far as the bitstream goes
+  const uint8_t *data = in + offset;
+  uint64_t data_len = size - sizeof(uint64_t) - 1 - offset;
+  uint64_t num_bits;
+  memcpy(&num_bits, in + size - sizeof(uint64_t), sizeof(uint64_t));
+  if (num_bits > 8 * data_len)
+    num_bits = 8 * data_len;
+
+  // Threads beyond the cores only add copies, and below SPEC_MIN_THREADS the copies and the stitch pass cost more than
+  // the threads save
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores > 0 && num_threads > cores)
+    num_threads = (int)cores;
+  if (num_threads < 1)
+    num_threads = 1;
+  uint64_t num_chunks = num_bits / SPEC_MIN_CHUNK;
+  if (num_chunks > (uint64_t)num_threads)
+    num_chunks = (uint64_t)num_threads;
+  if (num_chunks < SPEC_MIN_THREADS)
+    return (unpack_bits(ws, data, data_len, out, *len) == *len) ? 0 : -1;
+
+  // A chunk holds at most one symbol per shortest code
+  uint8_t min_bits = MAX_CODE_BITS;
+  for (unsigned s = 0; s < 256; s++)
+    if (ws->table[s].num_bits && ws->table[s].num_bits < min_bits)
+      min_bits = ws->table[s].num_bits;
+
+  int failed = 0;
+  SpecChunk *chunks = (SpecChunk *)calloc(num_chunks, sizeof(SpecChunk));
+  uint64_t *marks = (uint64_t *)calloc(num_bits / 64 + 1, sizeof(uint64_t));
+  if (mem_check(chunks, "chunks") || mem_check(marks, "marks"))
+  {
+    failed = -1;
+    goto done;
+  }
+
+  // Chunks start on whole words of the bitmap, so that no two of them write the same word
+  for (uint64_t i = 0; i < num_chunks && !failed; i++)
+  {
+    SpecChunk *chunk = &chunks[i];
+    chunk->ws = ws;
+    chunk->data = data;
+    chunk->num_bits = num_bits;
+    chunk->start = (num_bits * i / num_chunks) & ~(uint64_t)63;
+    chunk->stop = (i + 1 < num_chunks) ? (num_bits * (i + 1) / num_chunks) & ~(uint64_t)63 : num_bits;
+    chunk->marks = marks;
+
+    // The first chunk starts on a code, so it decodes in place
+    if (i == 0)
+    {
+      chunk->out = out;
+      chunk->capacity = *len;
+      continue;
+    }
+    chunk->capacity = (chunk->stop - chunk->start) / min_bits + 1;
+    if (chunk->capacity > *len)
+      chunk->capacity = *len;
+    chunk->out = (uint8_t *)malloc(chunk->capacity + 1);
+    failed = mem_check(chunk->out, "chunk->out");
+  }
+  if (failed)
+    goto done;
+
+  run_pool(spec_worker, chunks, (int)num_chunks);
+
+  // Follow the true codes into each chunk until they meet a symbol the chunk decoded, then take the rest of it
+  BitCursor cur;
+  seek_bits(&cur, data, num_bits, chunks[0].end);
+  uint64_t count = chunks[0].count;
+  for (uint64_t i = 1; i < num_chunks && !failed && count < *len; i++)
+  {
+    SpecChunk *chunk = &chunks[i];
+    for (uint64_t pos = cursor_pos(&cur); pos < chunk->stop && count < *len; pos = cursor_pos(&cur))
+    {
+      if (pos >= chunk->start && pos < chunk->end && (marks[pos >> 6] >> (pos & 63)) & 0x01)
+      {
+        uint64_t first = spec_rank(chunk, pos);
+        uint64_t num = chunk->count - first;
+        if (num > *len - count)
+          num = *len - count;
+        memcpy(out + count, chunk->out + first, num);
+        count += num;
+        seek_bits(&cur, data, num_bits, chunk->end);
+        continue;
+      }
+
+      if (!next_code(ws, &cur, &out[count]))
+      {
+        failed = -1;
+        break;
+      }
+      count++;
+    }
+  }
+  if (count != *len)
+    failed = -1;
+
+done:
+  for (uint64_t i = 1; chunks && i < num_chunks; i++)
+    free(chunks[i].out);
+  free(chunks);
+  free(marks);
+  return failed ? -1 : 0;
+}
+
+// Whether the block in the workspace needs a fresh codebook; otherwise switch the workspace to `old`
+static bool need_book(Workspace *ws, CodeTable *old, double threshold)
+{
+  uint64_t old_bits = 0;
+
+  if (!old)
+    return true;
+
+  // A symbol without a code forces a fresh codebook
+  for (unsigned s = 0; s < 256; s++)
+  {
+    if (ws->freqs[s] && !old[s].num_bits)
+      return true;
+    old_bits += ws->freqs[s] * old[s].num_bits;
+  }
+
+  // A fresh codebook also pays for its own header
+  uint64_t fresh_bits = ws->total_bits + 8 * book_size(ws->table);
+  printf("[Info]\tOld codebook: %llu bits, fresh codebook: %llu bits\n",
+         (unsigned long long)old_bits, (unsigned long long)fresh_bits);
+  if ((double)old_bits > (1.0 + threshold) * (double)fresh_bits)
+    return true;
+
+  memcpy(ws->table, old, 256 * sizeof(CodeTable));
+  ws->total_bits = old_bits;
+  return false;
+}
+
+int analyze_block(Workspace *ws, const uint8_t *msg, uint64_t len, uint8_t transforms, CodeTable *old,
+                  double threshold, Analysis *stats)
+{
+  const uint8_t *coded = msg;
+  uint8_t *transformed = NULL;
+  uint64_t coded_len = len, primary;
+
+  // The code lengths are the ones of the transformed block
+  if (transforms)
+  {
+    transformed = apply_transforms(transforms, msg, len, &coded_len, &primary);
+    if (!transformed)
+      return -1;
+    coded = transformed;
+  }
+
+  if (build_workspace(ws, coded, coded_len))
+    return -1;
+
+  // Shannon entropy of the histogram
+  stats->entropy = 0.0;
+  for (unsigned s = 0; s < 256; s++)
+    if (ws->freqs[s])
+    {
+      double p = (double)ws->freqs[s] / (double)coded_len;
+      stats->entropy -= p * log2(p);
+    }
+
+  // The same codebook choice as `append_archive()`
+  stats->fresh_book = need_book(ws, old, threshold);
+
+  stats->len = len;
+  stats->total_bits = ws->total_bits;
+  stats->header_bytes = 1 + 2 * sizeof(uint64_t);
+  if (stats->fresh_book)
+    stats->header_bytes += book_size(ws->table);
+  if (transforms)
+    stats->header_bytes += 2 * sizeof(uint64_t);
+  stats->payload_bytes = (ws->total_bits + 7) / 8;
+
+  free(transformed);
+  return 0;
+}
+
+/* ******************************************** */
+
+Block *read_blocks(FILE *fp, uint64_t *num_blocks)
+{
+  uint8_t sign[8];
+  uint64_t capacity = 16;
+  uint64_t book_offset = 0, book_len = 0;
+
+  // Get file size
+  fseek(fp, 0, SEEK_END);
+  uint64_t size = ftell(fp);
+
+  fseek(fp, 0, SEEK_SET);
+  if (fread(sign, sizeof(uint8_t), ARCHIVE_SIGN_LEN, fp) != ARCHIVE_SIGN_LEN || memcmp(sign, ARCHIVE_SIGN, ARCHIVE_SIGN_LEN))
+  {
+    fprintf(stderr, "[Error]\tInvalid signature\n");
+    return NULL;
+  }
+
+  Block *blocks = (Block *)malloc(capacity * sizeof(Block));
+  if (mem_check(blocks, "blocks"))
+    return NULL;
+
+  *num_blocks = 0;
+  for (;;)
+  {
+    Block blk;
+    if (fread(&blk.flags, sizeof(uint8_t), 1, fp) != 1)
+      break;
+    if (fread(&blk.len, sizeof(uint64_t), 1, fp) != 1 || fread(&blk.num_bits, sizeof(uint64_t), 1, fp) != 1)
+      goto invalid;
+
+    // Transformed blocks code a different number of symbols
+    blk.coded_len = blk.len;
+    blk.primary = 0;
+    if (blk.flags & BLOCK_TRANSFORMS)
+      if (fread(&blk.coded_len, sizeof(uint64_t), 1, fp) != 1 || fread(&blk.primary, sizeof(uint64_t), 1, fp) != 1)
+        goto invalid;
+
+    // Follow the codebook, or keep the one of the previous block
+    if (blk.flags & BLOCK_WIDE)
+    {
+      if (!(blk.flags & BLOCK_BOOK) || fread(&blk.book_len, sizeof(uint64_t), 1, fp) != 1)
+        goto invalid;
+      blk.book_offset = ftell(fp);
+      if (blk.book_offset + blk.book_len > size)
+        goto invalid;
+      fseek(fp, blk.book_offset + blk.book_len, SEEK_SET);
+
+      // Nothing to reuse after a wide block
+      book_len = 0;
+    }
+    else
+    {
+      if (blk.flags & BLOCK_BOOK)
+      {
+        uint8_t book[sizeof(((Workspace *)0)->book)];
+        book_offset = ftell(fp);
+        size_t read = fread(book, sizeof(uint8_t), sizeof(book), fp);
+        book_len = check_book(book, read);
+        if (!book_len)
+          goto invalid;
+        fseek(fp, book_offset + book_len, SEEK_SET);
+      }
+      else if (!book_len)
+        goto invalid;
+
+      blk.book_offset = book_offset;
+      blk.book_len = book_len;
+    }
+    blk.offset = ftell(fp);
+
+    // Skip over the bitstream
+    uint64_t bytes = (blk.num_bits + 7) / 8;
+    if (blk.offset + bytes > size)
+      goto invalid;
+    fseek(fp, blk.offset + bytes, SEEK_SET);
+
+    if (*num_blocks == capacity)
+    {
+      capacity *= 2;
+      blocks = (Block *)realloc(blocks, capacity * sizeof(Block));
+      if (mem_check(blocks, "blocks"))
+        return NULL;
+    }
+    blocks[(*num_blocks)++] = blk;
+  }
+
+  return blocks;
+
+invalid:
+  fprintf(stderr, "[Error]\tInvalid block %llu\n", (unsigned long long)*num_blocks);
+  free(blocks);
+  return NULL;
+}
+
+int write_block(FILE *fp, Workspace *ws, Block *blk, const uint8_t *coded)
+{
+  uint64_t bytes = (ws->total_bits + 7) / 8;
+
+  blk->num_bits = ws->total_bits;
+  fwrite(&blk->flags, sizeof(uint8_t), 1, fp);
+  fwrite(&blk->len, sizeof(uint64_t), 1, fp);
+  fwrite(&blk->num_bits, sizeof(uint64_t), 1, fp);
+
+  if (blk->flags & BLOCK_TRANSFORMS)
+  {
+    fwrite(&blk->coded_len, sizeof(uint64_t), 1, fp);
+    fwrite(&blk->primary, sizeof(uint64_t), 1, fp);
+  }
+
+  if (blk->flags & BLOCK_BOOK)
+  {
+    uint8_t book[sizeof(ws->book)];
+    uint8_t *end = write_book(ws->table, book);
+    fwrite(book, sizeof(uint8_t), end - book, fp);
+  }
+
+  uint8_t *data = (uint8_t *)malloc(bytes + 1);
+  if (mem_check(data, "data"))
+    return -1;
+
+  pack_bits(ws->table, coded, blk->coded_len, data);
+  size_t written = fwrite(data, sizeof(uint8_t), bytes, fp);
+  free(data);
+
+  return (written == bytes) ? 0 : -1;
+}
+
+// Write a block coded by the wide coder, with its codebook section after its length
+static int write_wide_block(FILE *fp, WideCoder *wc, Block *blk)
+{
+  uint64_t bytes = (wc->total_bits + 7) / 8;
+  uint64_t book_len = wide_book_size(wc, blk->flags);
+
+  blk->num_bits = wc->total_bits;
+  fwrite(&blk->flags, sizeof(uint8_t), 1, fp);
+  fwrite(&blk->len, sizeof(uint64_t), 1, fp);
+  fwrite(&blk->num_bits, sizeof(uint64_t), 1, fp);
+
+  if (blk->flags & BLOCK_TRANSFORMS)
+  {
+    fwrite(&blk->coded_len, sizeof(uint64_t), 1, fp);
+    fwrite(&blk->primary, sizeof(uint64_t), 1, fp);
+  }
+
+  uint8_t *book = (uint8_t *)malloc(book_len);
+  uint8_t *data = (uint8_t *)malloc(bytes + 1);
+  if (mem_check(book, "book") || mem_check(data, "data"))
+    return -1;
+
+  wide_write_book(wc, blk->flags, book);
+  fwrite(&book_len, sizeof(uint64_t), 1, fp);
+  fwrite(book, sizeof(uint8_t), book_len, fp);
+
+  wide_pack(wc, data);
+  size_t written = fwrite(data, sizeof(uint8_t), bytes, fp);
+  free(book);
+  free(data);
+
+  return (written == bytes) ? 0 : -1;
+}
+
+// Estimated bits of a block with its own codebook: the entropy, a codebook entry per symbol and the header
+static double block_cost(double num, double sum_flogf, unsigned num_symbols)
+{
+  double payload = (num > 0) ? num * log2(num) - sum_flogf : 0.0;
+  return payload + 8.0 * (1 + 3 * sizeof(uint64_t) + 3 * num_symbols);
+}
+
+static double flogf(uint64_t f)
+{
+  return f ? (double)f * log2((double)f) : 0.0;
+}
+
+double hist_cost(size_t *freqs, uint64_t num)
+{
+  double sum = 0.0;
+  unsigned num_symbols = 0;
+  for (unsigned s = 0; s < 256; s++)
+    if (freqs[s])
+    {
+      sum += flogf(freqs[s]);
+      num_symbols++;
+    }
+  return block_cost((double)num, sum, num_symbols);
+}
+
+// Merge windows while the merged block is cheaper than starting a new codebook
+static uint64_t split_greedy(const uint8_t *msg, uint64_t len, uint64_t window, uint64_t *lens)
+{
+  size_t cur[256], next[256], merged[256];
+  uint64_t num_blocks = 0;
+
+  uint64_t first = (len < window) ? len : window;
+  count_symbols(cur, msg, first);
+  lens[0] = first;
+
+  for (uint64_t pos = first; pos < len; pos += window)
+  {
+    uint64_t size = (len - pos < window) ? len - pos : window;
+    count_symbols(next, msg + pos, size);
+    for (unsigned s = 0; s < 256; s++)
+      merged[s] = cur[s] + next[s];
+
+    double split = hist_cost(cur, lens[num_blocks]) + hist_cost(next, size);
+    if (hist_cost(merged, lens[num_blocks] + size) <= split)
+    {
+      memcpy(cur, merged, sizeof(cur));
+      lens[num_blocks] += size;
+    }
+    else
+    {
+      memcpy(cur, next, sizeof(cur));
+      lens[++num_blocks] = size;
+    }
+  }
+
+  return num_blocks + 1;
+}
+
+// Cheapest split on window boundaries, by dynamic programming over the end of the last block
+static uint64_t split_optimal(const uint8_t *msg, uint64_t len, uint64_t window, uint64_t *lens)
+{
+  size_t freqs[256], acc[256];
+  uint64_t num_blocks = 0;
+
+  // Longer inputs get wider windows, so that a block may span the whole input and the search stays quadratic in
+  // SPLIT_MAX_WINDOWS
+  if ((len + window - 1) / window > SPLIT_MAX_WINDOWS)
+    window = (len + SPLIT_MAX_WINDOWS - 1) / SPLIT_MAX_WINDOWS;
+  uint64_t num_windows = (len + window - 1) / window;
+
+  uint64_t *starts = (uint64_t *)malloc((num_windows + 1) * sizeof(uint64_t));
+  uint8_t *symbols = (uint8_t *)malloc(num_windows * 256 * sizeof(uint8_t));
+  size_t *counts = (size_t *)malloc(num_windows * 256 * sizeof(size_t));
+  double *best = (double *)malloc((num_windows + 1) * sizeof(double));
+  uint64_t *from = (uint64_t *)malloc((num_windows + 1) * sizeof(uint64_t));
+  if (mem_check(starts, "starts") || mem_check(symbols, "symbols") || mem_check(counts, "counts") ||
+      mem_check(best, "best") || mem_check(from, "from"))
+    goto done;
+
+  // Sparse histogram of each window, holding only the symbols it has
+  starts[0] = 0;
+  for (uint64_t w = 0; w < num_windows; w++)
+  {
+    uint64_t size = (len - w * window < window) ? len - w * window : window;
+    count_symbols(freqs, msg + w * window, size);
+
+    starts[w + 1] = starts[w];
+    for (unsigned s = 0; s < 256; s++)
+      if (freqs[s])
+      {
+        symbols[starts[w + 1]] = (uint8_t)s;
+        counts[starts[w + 1]++] = freqs[s];
+      }
+  }
+
+  // Grow the last block backward, updating its entropy one window at a time
+  best[0] = 0.0;
+  for (uint64_t j = 1; j <= num_windows; j++)
+  {
+    double sum = 0.0;
+    unsigned num_symbols = 0;
+
+    memset(acc, 0, sizeof(acc));
+    best[j] = -1.0;
+    for (uint64_t i = j; i-- > 0;)
+    {
+      for (uint64_t k = starts[i]; k < starts[i + 1]; k++)
+      {
+        size_t *f = &acc[symbols[k]];
+        num_symbols += (*f == 0);
+        sum += flogf(*f + counts[k]) - flogf(*f);
+        *f += counts[k];
+      }
+
+      uint64_t num = ((j * window < len) ? j * window : len) - i * window;
+      double cost = best[i] + block_cost((double)num, sum, num_symbols);
+      if (best[j] < 0.0 || cost < best[j])
+      {
+        best[j] = cost;
+        from[j] = i;
+      }
+    }
+  }
+
+  // Walk back the chosen boundaries
+  for (uint64_t j = num_windows; j > 0; j = from[j])
+    num_blocks++;
+  for (uint64_t j = num_windows, b = num_blocks; j > 0; j = from[j])
+    lens[--b] = ((j * window < len) ? j * window : len) - from[j] * window;
+
+done:
+  free(starts);
+  free(symbols);
+  free(counts);
+  free(best);
+  free(from);
+  return num_blocks;
+}
+
+// Cut the blocks longer than `max` octets into even parts, in place in `lens` which has room for them, and return the
+// number of blocks
+static uint64_t cut_blocks(uint64_t *lens, uint64_t num_blocks, uint64_t max)
+{
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < num_blocks; i++)
+    total += (lens[i] + max - 1) / max;
+
+  // From the last block, so that the parts never overwrite a block still to cut
+  for (uint64_t i = num_blocks, k = total; i-- > 0;)
+  {
+    uint64_t len = lens[i], num_parts = (len + max - 1) / max;
+    for (uint64_t p = num_parts; p-- > 0;)
+      lens[--k] = len * (p + 1) / num_parts - len * p / num_parts;
+  }
+  return total;
+}
+
+uint64_t plan_blocks(const uint8_t *msg, uint64_t len, const ArchiveOpts *opts, uint64_t **lens)
+{
+  bool bwt = (opts->transforms & BLOCK_BWT) || opts->auto_transforms;
+  uint64_t size = opts->block_size;
+  if (opts->split != SPLIT_FIXED && !size)
+    size = SPLIT_WINDOW;
+  if (bwt && !size)
+    size = BWT_BLOCK_SIZE;
+  if (!size || size > len)
+    size = len ? len : 1;
+
+  // There are never more blocks than windows, and the blocks of an adaptive split too long for the BWT are cut
+  uint64_t num_blocks = (len + size - 1) / size;
+  *lens = (uint64_t *)malloc((num_blocks + len / BWT_BLOCK_SIZE + 1) * sizeof(uint64_t));
+  if (mem_check(*lens, "lens") || !len)
+    return 0;
+
+  if (opts->split == SPLIT_GREEDY)
+    num_blocks = split_greedy(msg, len, size, *lens);
+  else if (opts->split == SPLIT_OPTIMAL)
+    num_blocks = split_optimal(msg, len, size, *lens);
+  else
+  {
+    for (uint64_t i = 0; i < num_blocks; i++)
+      (*lens)[i] = (len - i * size < size) ? len - i * size : size;
+    return num_blocks;
+  }
+  return bwt ? cut_blocks(*lens, num_blocks, BWT_BLOCK_SIZE) : num_blocks;
+}
+
+// Read the codebook section of a block
+static int read_block_book(FILE *fp, Block *blk, uint8_t *book)
+{
+  fseek(fp, blk->book_offset, SEEK_SET);
+  return (fread(book, sizeof(uint8_t), blk->book_len, fp) == blk->book_len) ? 0 : -1;
+}
+
+int append_archive(FILE *fp, const uint8_t *msg, uint64_t len, const ArchiveOpts *opts)
+{
+  Block *blocks = NULL;
+  uint64_t num_blocks = 0;
+  CodeTable old[256];
+  bool have_old = false;
+  Workspace *ws = NULL;
+  WideCoder *wc = NULL;
+  uint64_t *lens = NULL;
+  TransformTask *tasks = NULL;
+  uint64_t num_tasks = 0;
+  int ret = 0;
+
+  fseek(fp, 0, SEEK_END);
+  if (ftell(fp) == 0)
+    fwrite(ARCHIVE_SIGN, sizeof(uint8_t), ARCHIVE_SIGN_LEN, fp);
+  else
+  {
+    blocks = read_blocks(fp, &num_blocks);
+    if (!blocks)
+      return -1;
+  }
+
+  if (!len)
+    goto done;
+
+  ws = (Workspace *)malloc(sizeof(Workspace));
+  wc = opts->symbols ? new_wide_coder(opts->table_bits) : NULL;
+  if (mem_check(ws, "ws") || (opts->symbols && !wc))
+  {
+    ret = -1;
+    goto done;
+  }
+
+  // Start from the codebook of the last block, unless it is wide
+  if (num_blocks && !(blocks[num_blocks - 1].flags & BLOCK_WIDE))
+  {
+    uint8_t book[sizeof(ws->book)];
+    if (read_block_book(fp, &blocks[num_blocks - 1], book))
+    {
+      ret = -1;
+      goto done;
+    }
+    load_table(old, book);
+    have_old = true;
+  }
+
+  // Split the input, and transform the blocks in parallel
+  num_tasks = plan_blocks(msg, len, opts, &lens);
+  tasks = (TransformTask *)calloc(num_tasks, sizeof(TransformTask));
+  if (!num_tasks || mem_check(tasks, "tasks"))
+  {
+    ret = -1;
+    goto done;
+  }
+
+  for (uint64_t i = 0, pos = 0; i < num_tasks; pos += lens[i++])
+  {
+    tasks[i].in = msg + pos;
+    tasks[i].len = lens[i];
+    tasks[i].flags = opts->transforms;
+    tasks[i].choose = opts->auto_transforms;
+  }
+  if ((opts->transforms || opts->auto_transforms) && transform_blocks(tasks, num_tasks, opts->num_threads))
+    ret = -1;
+
+  // Encode the blocks in order, as each one may reuse the codebook of the previous one
+  for (uint64_t i = 0; i < num_tasks && !ret; i++)
+  {
+    TransformTask *task = &tasks[i];
+    const uint8_t *coded = task->flags ? task->out : task->in;
+    Block blk = {
+        .flags = task->flags,
+        .len = task->len,
+        .coded_len = task->flags ? task->out_len : task->len,
+        .primary = task->primary,
+    };
+
+    // Wide blocks always carry their codebook
+    if (opts->symbols)
+    {
+      blk.flags |= BLOCK_BOOK | opts->symbols;
+      if (wide_symbols(wc, blk.flags, coded, blk.coded_len, opts->num_tokens) || wide_build(wc))
+      {
+        ret = -1;
+        break;
+      }
+
+      fseek(fp, 0, SEEK_END);
+      ret = write_wide_block(fp, wc, &blk);
+      printf("[Info]\tAppended block %llu (%llu octets, %u of %u symbols)\n", (unsigned long long)(num_blocks + i),
+             (unsigned long long)blk.len, wc->num_used, wc->num_symbols);
+      continue;
+    }
+
+    if (build_workspace(ws, coded, blk.coded_len))
+    {
+      ret = -1;
+      break;
+    }
+    if (need_book(ws, have_old ? old : NULL, opts->threshold))
+      blk.flags |= BLOCK_BOOK;
+
+    fseek(fp, 0, SEEK_END);
+    ret = write_block(fp, ws, &blk, coded);
+    printf("[Info]\tAppended block %llu (%llu octets, %s codebook)\n", (unsigned long long)(num_blocks + i),
+           (unsigned long long)blk.len, (blk.flags & BLOCK_BOOK) ? "fresh" : "reused");
+
+    memcpy(old, ws->table, sizeof(old));
+    have_old = true;
+  }
+
+done:
+  for (uint64_t i = 0; tasks && i < num_tasks; i++)
+    free(tasks[i].out);
+  free(tasks);
+  free(lens);
+  free(blocks);
+  del_wide_coder(wc);
+  free(ws);
+  return ret;
+}
+
+// Read exactly `len` octets at `offset`
+static int read_at(int fd, void *data, uint64_t len, uint64_t offset)
+{
+  uint8_t *p = (uint8_t *)data;
+  while (len)
+  {
+    ssize_t n = pread(fd, p, len, offset);
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= (uint64_t)n;
+    offset += (uint64_t)n;
+  }
+  return 0;
+}
+
+// Decode the bitstream of a wide block, creating the wide coder on first use
+static int unpack_wide(int fd, Block *blk, WideCoder **wide, uint8_t lut_bits, const uint8_t *data, uint8_t *coded)
+{
+  if (!*wide && !(*wide = new_wide_coder(lut_bits)))
+    return -1;
+
+  uint8_t *book = (uint8_t *)malloc(blk->book_len + 1);
+  if (mem_check(book, "book"))
+    return -1;
+
+  int failed = read_at(fd, book, blk->book_len, blk->book_offset) ||
+               wide_load_book(*wide, blk->flags, book, blk->book_len) ||
+               wide_unpack(*wide, blk->flags, data, blk->num_bits, coded, blk->coded_len);
+  free(book);
+  return failed ? -1 : 0;
+}
+
+// Decode a block into `out`, reusing the decoding tree of the workspace if the codebook is unchanged;
+// wide blocks go through `*wide`, created on first use
+static int decode_block(int fd, Block *blk, Workspace *ws, WideCoder **wide, uint8_t *out)
+{
+  uint8_t book[sizeof(ws->book)];
+  uint64_t bytes = (blk->num_bits + 7) / 8;
+  bool transformed = blk->flags & BLOCK_TRANSFORMS;
+
+  // Transformed blocks are decoded aside, then inverted into place
+  uint8_t *data = (uint8_t *)malloc(bytes + 1);
+  uint8_t *coded = transformed ? (uint8_t *)malloc(blk->coded_len + 1) : out;
+  if (mem_check(data, "data") || mem_check(coded, "coded"))
+    return -1;
+
+  int failed = read_at(fd, data, bytes, blk->offset);
+  if (!failed && (blk->flags & BLOCK_WIDE))
+    failed = unpack_wide(fd, blk, wide, ws->lut_bits, data, coded);
+  else if (!failed)
+    failed = read_at(fd, book, blk->book_len, blk->book_offset) || use_book(ws, book, blk->book_len, blk->coded_len) ||
+             unpack_bits(ws, data, bytes, coded, blk->coded_len) != blk->coded_len;
+  if (!failed && transformed)
+    failed = invert_transforms(blk->flags, coded, blk->coded_len, blk->primary, out, blk->len);
+
+  free(data);
+  if (transformed)
+    free(coded);
+  return failed ? -1 : 0;
+}
+
+// Blocks left to a worker: it takes from the head, and the others steal from the tail
+typedef struct block_queue_t
+{
+  uint64_t head;
+  uint64_t tail;
+  pthread_mutex_t lock;
+} BlockQueue;
+
+// State shared by the workers of `decode_archive()`
+typedef struct decode_job_t
+{
+  int fd;
+  Block *blocks;
+  uint64_t *offsets; // offset of each block in `out`
+  uint8_t *out;
+  BlockQueue *queues; // one per worker
+  int num_workers;
+  uint8_t table_bits;
+  bool *done; // decoded blocks
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} DecodeJob;
+
+// Take the next block of the own queue, or steal the last block of another
+static bool take_block(DecodeJob *job, int id, uint64_t *idx)
+{
+  for (int k = 0; k < job->num_workers; k++)
+  {
+    BlockQueue *queue = &job->queues[(id + k) % job->num_workers];
+    bool found = false;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
+    {
+      *idx = (k == 0) ? queue->head++ : --queue->tail;
+      found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (found)
+      return true;
+  }
+  return false;
+}
+
+// Record the failure of a worker, and wake up the thread waiting on the blocks
+static void fail_job(DecodeJob *job)
+{
+  pthread_mutex_lock(&job->lock);
+  job->failed = -1;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static bool job_failed(DecodeJob *job)
+{
+  pthread_mutex_lock(&job->lock);
+  bool failed = job->failed;
+  pthread_mutex_unlock(&job->lock);
+  return failed;
+}
+
+static void decode_worker(void *arg, int id)
+{
+  DecodeJob *job = (DecodeJob *)arg;
+  WideCoder *wide = NULL;
+  uint64_t idx;
+
+  // The blocks of this worker would never complete, so the whole decode fails
+  Workspace *ws = (Workspace *)malloc(sizeof(Workspace));
+  if (mem_check(ws, "ws"))
+  {
+    fail_job(job);
+    return;
+  }
+  ws->book_len = 0;
+  ws->lut_bits = job->table_bits;
+
+  while (!job_failed(job) && take_block(job, id, &idx))
+  {
+    int failed = decode_block(job->fd, &job->blocks[idx], ws, &wide, job->out + job->offsets[idx]);
+    if (failed)
+      fprintf(stderr, "[Error]\tFailed to decode block %llu\n", (unsigned long long)idx);
+
+    pthread_mutex_lock(&job->lock);
+    job->done[idx] = true;
+    job->failed |= failed;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+  }
+
+  del_wide_coder(wide);
+  free(ws);
+}
+
+Buffer *decode_archive(FILE *fp, const ArchiveOpts *opts, BlockSink sink, void *arg)
+{
+  uint64_t num_blocks, total = 0;
+  int num_threads = opts->num_threads;
+  Block *blocks = read_blocks(fp, &num_blocks);
+  if (!blocks)
+    return NULL;
+
+  if (num_threads < 1)
+    num_threads = 1;
+  if ((uint64_t)num_threads > num_blocks)
+    num_threads = num_blocks ? (int)num_blocks : 1;
+
+  DecodeJob job = {
+      .fd = fileno(fp),
+      .blocks = blocks,
+      .num_workers = num_threads,
+      .table_bits = opts->table_bits,
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .cond = PTHREAD_COND_INITIALIZER,
+  };
+  Buffer *buf = NULL;
+  job.offsets = (uint64_t *)malloc((num_blocks + 1) * sizeof(uint64_t));
+  job.done = (bool *)calloc(num_blocks + 1, sizeof(bool));
+  job.queues = (BlockQueue *)calloc(num_threads, sizeof(BlockQueue));
+  if (mem_check(job.offsets, "offsets") || mem_check(job.done, "done") || mem_check(job.queues, "queues"))
+  {
+    job.failed = -1;
+    goto done;
+  }
+
+  // Every block has its final place in the output
+  for (uint64_t i = 0; i < num_blocks; i++)
+  {
+    job.offsets[i] = total;
+    total += blocks[i].len;
+  }
+
+  buf = new_buffer(total + 1);
+  if (mem_check(buf, "buf"))
+  {
+    job.failed = -1;
+    goto done;
+  }
+  job.out = buf->buffer;
+
+  // Each worker starts with a contiguous range, so that it decodes in order unless it steals
+  for (int i = 0; i < num_threads; i++)
+  {
+    job.queues[i].head = num_blocks * i / num_threads;
+    job.queues[i].tail = num_blocks * (i + 1) / num_threads;
+    pthread_mutex_init(&job.queues[i].lock, NULL);
+  }
+
+  // This thread hands the blocks to the sink, unless no worker starts
+  ThreadPool pool;
+  if (!start_pool(&pool, decode_worker, &job, 0, num_threads))
+    decode_worker(&job, 0);
+
+  // Hand the decoded prefix to the sink as soon as it grows
+  uint64_t next = 0;
+  pthread_mutex_lock(&job.lock);
+  while (next < num_blocks && !job.failed)
+  {
+    if (!job.done[next])
+    {
+      pthread_cond_wait(&job.cond, &job.lock);
+      continue;
+    }
+
+    uint64_t first = next;
+    while (next < num_blocks && job.done[next])
+      next++;
+    pthread_mutex_unlock(&job.lock);
+
+    uint64_t len = ((next < num_blocks) ? job.offsets[next] : total) - job.offsets[first];
+    int failed = sink ? sink(buf->buffer + job.offsets[first], len, arg) : 0;
+    buf->len += len;
+
+    pthread_mutex_lock(&job.lock);
+    job.failed |= failed;
+  }
+  pthread_mutex_unlock(&job.lock);
+
+  join_pool(&pool);
+  for (int i = 0; i < num_threads; i++)
+    pthread_mutex_destroy(&job.queues[i].lock);
+
+done:
+  pthread_mutex_destroy(&job.lock);
+  pthread_cond_destroy(&job.cond);
+  if (job.failed)
+  {
+    del_buffer(buf);
+    buf = NULL;
+  }
+
+  free(job.offsets);
+  free(job.done);
+  free(job.queues);
+  free(blocks);
+  return buf;
+}
+
+Buffer *read_archive(FILE *fp)
+{
+  ArchiveOpts opts = {.num_threads = 1, .table_bits = LUT_BITS};
+  return decode_archive(fp, &opts, NULL, NULL);
+}
+
+/* ******************************************** */
+
+// Candidates per octet of a bitstream above which the block is decoded and scanned instead
+#define SEARCH_DENSITY 8
+
+// Describe a stream written by `encode()` as a single untransformed block
+static Block *read_stream_block(FILE *fp)
+{
+  uint8_t book[sizeof(((Workspace *)0)->book)];
+  uint8_t head[1 + sizeof(uint64_t) + 1], tail[1 + sizeof(uint64_t)];
+
+  Block *blk = (Block *)calloc(1, sizeof(Block));
+  if (mem_check(blk, "blk"))
+    return NULL;
+
+  fseek(fp, 0, SEEK_END);
+  uint64_t size = ftell(fp);
+
+  // Codebook, then the separators around the original length
+  blk->book_offset = FILE_SIGN_LEN;
+  fseek(fp, blk->book_offset, SEEK_SET);
+  blk->book_len = check_book(book, fread(book, sizeof(uint8_t), sizeof(book), fp));
+  fseek(fp, blk->book_offset + blk->book_len, SEEK_SET);
+  if (!blk->book_len || fread(head, sizeof(head), 1, fp) != 1 || head[0] != GROUP_SEPARATOR ||
+      head[sizeof(head) - 1] != GROUP_SEPARATOR)
+    goto invalid;
+  memcpy(&blk->len, head + 1, sizeof(uint64_t));
+  blk->coded_len = blk->len;
+  blk->offset = blk->book_offset + blk->book_len + sizeof(head);
+
+  // Separator and number of bits at the end
+  if (size < blk->offset + sizeof(tail))
+    goto invalid;
+  fseek(fp, size - sizeof(tail), SEEK_SET);
+  if (fread(tail, sizeof(tail), 1, fp) != 1 || tail[0] != GROUP_SEPARATOR)
+    goto invalid;
+  memcpy(&blk->num_bits, tail + 1, sizeof(uint64_t));
+  if (blk->num_bits > 8 * (size - sizeof(tail) - blk->offset))
+    goto invalid;
+  return blk;
+
+invalid:
+  fprintf(stderr, "[Error]\tInvalid file format\n");
+  free(blk);
+  return NULL;
+}
+
+// Whole codes at the start of the next `ws->lut_built` bits of a bitstream, to count symbols without decoding them
+typedef struct skip_entry_t
+{
+  uint8_t count;    // number of codes (0 if the first one is longer than the table)
+  uint8_t num_bits; // length of these codes together
+} SkipEntry;
+
+// Fill the skip table of the lookup table of the workspace
+static void build_skip(Workspace *ws, SkipEntry *skip)
+{
+  uint8_t bits = ws->lut_built;
+  uint32_t mask = ((uint32_t)1 << bits) - 1;
+
+  for (uint32_t v = 0; v <= mask; v++)
+  {
+    uint8_t count = 0, used = 0;
+    LutEntry entry = ws->lut[v];
+
+    // The bits past the prefix read as zeros, which does not change the codes that fit in it
+    while (entry.num_bits && used + entry.num_bits <= bits)
+    {
+      used += entry.num_bits;
+      count++;
+      entry = ws->lut[(v << used) & mask];
+    }
+    skip[v].count = count;
+    skip[v].num_bits = used;
+  }
+}
+
+// Walk the codes from the cursor, the `count`-th symbol, up to bit `target`: 1 if a symbol starts there, 0 if not, and
+// -1 if the bitstream is invalid
+static int walk_to(Workspace *ws, const SkipEntry *skip, BitCursor *cur, uint64_t *count, uint64_t target)
+{
+  uint8_t bits = ws->lut_built;
+  uint64_t pos = cursor_pos(cur);
+  uint8_t symbol;
+
+  while (pos < target)
+  {
+    // Whole codes at a time, as long as they all end before the target
+    load_bits(cur);
+    if (bits)
+    {
+      SkipEntry entry = skip[cur->acc >> (64 - bits)];
+      if (entry.count && entry.num_bits <= cur->have && pos + entry.num_bits <= target)
+      {
+        cur->acc <<= entry.num_bits;
+        cur->have -= entry.num_bits;
+        pos += entry.num_bits;
+        *count += entry.count;
+        continue;
+      }
+    }
+
+    if (!next_code(ws, cur, &symbol))
+      return -1;
+    pos = cursor_pos(cur);
+    (*count)++;
+  }
+  return (pos == target) ? 1 : 0;
+}
+
+// Pack the codes of a message into `bits`, and return the number of bits (UINT64_MAX if a symbol has no code)
+static uint64_t pack_pattern(CodeTable *table, const uint8_t *msg, uint64_t len, uint8_t *bits)
+{
+  uint64_t num_bits = 0;
+  for (uint64_t i = 0; i < len; i++)
+  {
+    if (!table[msg[i]].num_bits)
+      return UINT64_MAX;
+    num_bits += table[msg[i]].num_bits;
+  }
+  pack_bits(table, msg, len, bits);
+  return num_bits;
+}
+
+// Whether `num` bits of the bitstream from bit `pos` equal the first bits of `bits`
+static bool bits_equal(const uint8_t *data, uint64_t pos, const uint8_t *bits, uint64_t num)
+{
+  for (uint64_t b = 0; b < num; b++, pos++)
+    if (((data[pos >> 3] >> (7 - (pos & 0x07))) ^ (bits[b >> 3] >> (7 - (b & 0x07)))) & 0x01)
+      return false;
+  return true;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Find the bit offsets `num_pattern` bits of `bits` appear at in the bitstream, at each of the 8 alignments to the
+// octets; returns the sorted offsets (freed by the caller), or NULL if there are more than `max`
+static uint64_t *find_bits(const uint8_t *data, uint64_t num_bits, const uint8_t *bits, uint64_t num_pattern,
+                           uint64_t max, uint64_t *num)
+{
+  uint64_t capacity = 16;
+  uint64_t *found = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+  uint8_t *pat = (uint8_t *)malloc(2 * (num_pattern / 8 + 2));
+  if (mem_check(found, "found") || mem_check(pat, "pat"))
+    return NULL;
+  uint8_t *mask = pat + num_pattern / 8 + 2;
+
+  *num = 0;
+  for (uint8_t shift = 0; shift < 8 && shift + num_pattern <= num_bits; shift++)
+  {
+    // The pattern as it lies in the octets when starting `shift` bits into one
+    uint64_t width = (shift + num_pattern + 7) / 8;
+    memset(pat, 0, 2 * (num_pattern / 8 + 2));
+    for (uint64_t b = 0; b < num_pattern; b++)
+    {
+      uint64_t q = shift + b;
+      pat[q >> 3] |= ((bits[b >> 3] >> (7 - (b & 0x07))) & 0x01) << (7 - (q & 0x07));
+      mask[q >> 3] |= 0x80 >> (q & 0x07);
+    }
+
+    // Jump between the occurrences of a whole octet of the pattern, if it has one
+    uint64_t anchor = 0;
+    while (anchor < width && mask[anchor] != 0xFF)
+      anchor++;
+
+    uint64_t last = (num_bits - shift - num_pattern) / 8;
+    for (uint64_t j = 0; j <= last; j++)
+    {
+      if (anchor < width)
+      {
+        const uint8_t *hit = (const uint8_t *)memchr(data + j + anchor, pat[anchor], last - j + 1);
+        if (!hit)
+          break;
+        j = (uint64_t)(hit - data) - anchor;
+      }
+
+      uint64_t k = 0;
+      while (k < width && (data[j + k] & mask[k]) == pat[k])
+        k++;
+      if (k < width)
+        continue;
+
+      if (*num == max)
+      {
+        free(found);
+        free(pat);
+        return NULL;
+      }
+      if (*num == capacity)
+      {
+        capacity *= 2;
+        found = (uint64_t *)realloc(found, capacity * sizeof(uint64_t));
+        if (mem_check(found, "found"))
+          return NULL;
+      }
+      found[(*num)++] = 8 * j + shift;
+    }
+  }
+
+  free(pat);
+  qsort(found, *num, sizeof(uint64_t), cmp_u64);
+  return found;
+}
+
+// Scan a decoded block for the pattern, and update `ends`; returns the number of matches (-1 if the sink failed)
+static int64_t search_plain(const uint8_t *out, uint64_t len, uint64_t offset, const uint8_t *pattern, uint64_t plen,
+                            bool *ends, MatchSink sink, void *arg)
+{
+  int64_t matches = 0;
+
+  // Matches starting in the blocks before, the earliest first
+  for (uint64_t k = plen - 1; k > 0; k--)
+    if (ends[k] && plen - k <= len && !memcmp(out, pattern + k, plen - k))
+    {
+      if (sink && sink(offset - k, arg))
+        return -1;
+      matches++;
+    }
+
+  for (uint64_t i = 0; i + plen <= len; i++)
+  {
+    const uint8_t *hit = (const uint8_t *)memchr(out + i, pattern[0], len - plen - i + 1);
+    if (!hit)
+      break;
+    i = (uint64_t)(hit - out);
+    if (memcmp(hit, pattern, plen))
+      continue;
+    if (sink && sink(offset + i, arg))
+      return -1;
+    matches++;
+  }
+
+  // Prefixes of the pattern the output ends with, going from the longest so that `ends` is still the old one
+  for (uint64_t k = plen - 1; k > 0; k--)
+    if (k <= len)
+      ends[k] = !memcmp(out + len - k, pattern, k);
+    else
+      ends[k] = ends[k - len] && !memcmp(out, pattern + k - len, len);
+  return matches;
+}
+
+// Search the bitstream of a block for the codes of the pattern, and update `ends`; returns the number of matches (-1
+// on failure, and -2 if the block should be decoded and scanned instead)
+static int64_t search_coded(Workspace *ws, const uint8_t *data, Block *blk, uint64_t offset, const uint8_t *pattern,
+                            uint64_t plen, bool *ends, MatchSink sink, void *arg)
+{
+  int64_t matches = 0;
+  uint64_t count = 0, num = 0;
+  uint64_t *found = NULL;
+  SkipEntry skip[1 << LUT_MAX_BITS];
+  BitCursor cur;
+  uint8_t symbol;
+
+  // Codes are at most 32 bits
+  uint8_t *bits = (uint8_t *)malloc(sizeof(uint32_t) * plen + 1);
+  if (mem_check(bits, "bits"))
+    return -1;
+
+  // Occurrences of the codes, whether or not they start on a symbol
+  uint64_t num_pattern = pack_pattern(ws->table, pattern, plen, bits);
+  if (num_pattern != UINT64_MAX)
+  {
+    found = find_bits(data, blk->num_bits, bits, num_pattern, blk->num_bits / 8 / SEARCH_DENSITY + 16, &num);
+    if (!found)
+    {
+      free(bits);
+      return -2;
+    }
+  }
+
+  // Matches starting in the blocks before, the earliest first, against the first symbols
+  for (uint64_t k = plen - 1; k > 0; k--)
+  {
+    if (!ends[k])
+      continue;
+
+    uint64_t i;
+    seek_bits(&cur, data, blk->num_bits, 0);
+    for (i = 0; i < plen - k; i++)
+      if (!next_code(ws, &cur, &symbol) || cursor_pos(&cur) > blk->num_bits || symbol != pattern[k + i])
+        break;
+    if (i < plen - k)
+      continue;
+    if (sink && sink(offset - k, arg))
+      goto failed;
+    matches++;
+  }
+
+  // Occurrences that start on a symbol, counting the symbols before them in one walk through the block
+  if (ws->lut_built)
+    build_skip(ws, skip);
+  seek_bits(&cur, data, blk->num_bits, 0);
+  for (uint64_t i = 0; i < num; i++)
+  {
+    int on_symbol = walk_to(ws, skip, &cur, &count, found[i]);
+    if (on_symbol < 0 || (on_symbol && sink && sink(offset + count, arg)))
+      goto failed;
+    matches += on_symbol;
+  }
+
+  // Prefixes of the pattern the block ends with, the nearest to its end first
+  for (uint64_t k = plen - 1; k > 0; k--)
+  {
+    ends[k] = false;
+    uint64_t num_prefix = pack_pattern(ws->table, pattern, k, bits);
+    if (num_prefix == UINT64_MAX || num_prefix > blk->num_bits)
+      continue;
+
+    // Symbols before the walked position were all passed over
+    uint64_t at = blk->num_bits - num_prefix;
+    if (at < cursor_pos(&cur) || !bits_equal(data, at, bits, num_prefix))
+      continue;
+
+    int on_symbol = walk_to(ws, skip, &cur, &count, at);
+    if (on_symbol < 0)
+      goto failed;
+    ends[k] = on_symbol;
+  }
+
+  free(found);
+  free(bits);
+  return matches;
+
+failed:
+  free(found);
+  free(bits);
+  return -1;
+}
+
+// Grow `*data` to at least `need` octets, dropping its content
+static int reserve(uint8_t **data, uint64_t *capacity, uint64_t need)
+{
+  if (need <= *capacity)
+    return 0;
+
+  free(*data);
+  *data = (uint8_t *)malloc(need);
+  *capacity = *data ? need : 0;
+  return mem_check(*data, "data");
+}
+
+int64_t search_archive(FILE *fp, const uint8_t *pattern, uint64_t len, uint8_t table_bits, MatchSink sink, void *arg)
+{
+  uint8_t sign[8] = {0};
+  uint64_t num_blocks = 1, offset = 0, capacity = 0;
+  uint8_t book[sizeof(((Workspace *)0)->book)];
+  Block *blocks;
+
+  if (!len)
+    return -1;
+
+  // Archives, or a single stream
+  fseek(fp, 0, SEEK_SET);
+  if (fread(sign, sizeof(uint8_t), FILE_SIGN_LEN, fp) == FILE_SIGN_LEN && !memcmp(sign, FILE_SIGN, FILE_SIGN_LEN))
+    blocks = read_stream_block(fp);
+  else
+    blocks = read_blocks(fp, &num_blocks);
+  if (!blocks)
+    return -1;
+
+  // Whether the output so far ends with the first `k` octets of the pattern
+  bool *ends = (bool *)calloc(len, sizeof(bool));
+  Workspace *ws = (Workspace *)malloc(sizeof(Workspace));
+  WideCoder *wide = NULL;
+  uint8_t *data = NULL;
+  if (mem_check(ends, "ends") || mem_check(ws, "ws"))
+  {
+    free(ends);
+    free(ws);
+    free(blocks);
+    return -1;
+  }
+  ws->book_len = 0;
+  ws->lut_bits = table_bits;
+
+  int64_t matches = 0;
+  int fd = fileno(fp);
+  for (uint64_t i = 0; i < num_blocks && matches >= 0; offset += blocks[i++].len)
+  {
+    Block *blk = &blocks[i];
+    int64_t found = -2;
+
+    // The codes of transformed and wide blocks, and of blocks shorter than the pattern, are not searched
+    if (!(blk->flags & (BLOCK_TRANSFORMS | BLOCK_WIDE)) && blk->len >= len)
+    {
+      if (reserve(&data, &capacity, (blk->num_bits + 7) / 8 + 8))
+      {
+        matches = -1;
+        break;
+      }
+      memset(data + (blk->num_bits + 7) / 8, 0, 8);
+      if (read_at(fd, book, blk->book_len, blk->book_offset) || use_book(ws, book, blk->book_len, blk->coded_len) ||
+          read_at(fd, data, (blk->num_bits + 7) / 8, blk->offset))
+        found = -1;
+      else
+        found = search_coded(ws, data, blk, offset, pattern, len, ends, sink, arg);
+    }
+
+    if (found == -2)
+    {
+      if (reserve(&data, &capacity, blk->len + 1) || decode_block(fd, blk, ws, &wide, data))
+        found = -1;
+      else
+        found = search_plain(data, blk->len, offset, pattern, len, ends, sink, arg);
+    }
+
+    if (found < 0)
+    {
+      fprintf(stderr, "[Error]\tFailed to search block %llu\n", (unsigned long long)i);
+      matches = -1;
+    }
+    else
+      matches += found;
+  }
+
+  free(data);
+  del_wide_coder(wide);
+  free(ws);
+  free(ends);
+  free(blocks);
+  return matches;
+}
+
+/* ******************************************** */
+
 // #define __TEST__
 #ifdef __TEST__
 int main(void)
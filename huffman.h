@@ -7,7 +7,9 @@
 
 #define GROUP_SEPARATOR 0x29
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -22,6 +24,38 @@ int mem_check(void *ptr, const char *name);
 
 /* ******************************************** */
 
+// Work of a pool thread, given the state shared by the pool and the index of the thread
+typedef void (*PoolTask)(void *arg, int id);
+
+// Thread of a pool
+typedef struct pool_thread_t
+{
+  pthread_t thread;
+  PoolTask task;
+  void *arg;
+  int id;
+} PoolThread;
+
+// Threads started together on the same task
+typedef struct thread_pool_t
+{
+  PoolThread *threads;
+  int num_started; // number of running threads
+} ThreadPool;
+
+// Start up to `num_threads` threads on `task`, numbered from `first`, and return how many started (the first failure
+// stops the others)
+int start_pool(ThreadPool *pool, PoolTask task, void *arg, int first, int num_threads);
+
+// Wait for the threads of the pool, and free it
+void join_pool(ThreadPool *pool);
+
+// Run `task` once for each index under `num_threads` and wait for all of them, the calling thread taking index 0 and
+// the indices whose thread did not start
+void run_pool(PoolTask task, void *arg, int num_threads);
+
+/* ******************************************** */
+
 // Buffer to store the input
 typedef struct buffer_t
 {
@@ -30,6 +64,9 @@ typedef struct buffer_t
   uint64_t capacity; // capacity of the buffer
 } Buffer;
 
+// Allocate a new buffer
+Buffer *new_buffer(uint64_t capacity);
+
 // Initialize a stream buffer from a file
 Buffer *init_buf_from_file(FILE *fp);
 
@@ -123,9 +160,299 @@ int del_codebook(CodeBook *book);
 
 /* ******************************************** */
 
+// Bit writer of one encoding stream, so that streams do not share any state
+typedef struct huff_encoder_t
+{
+  FILE *fp;             // output stream
+  uint8_t byte;         // partial octet
+  uint8_t bit_idx;      // free bits left in `byte`
+  uint64_t num_bits;    // number of bits written
+  CodeTable table[256]; // codetable indexed by the symbol
+} HuffEncoder;
+
+// Start an encoding stream with the codebook
+void init_encoder(HuffEncoder *enc, FILE *fp, CodeBook *book);
+
+// Write a bit to the stream
+void write_bit(HuffEncoder *enc, uint8_t bit);
+
+// Write the code of a codetable to the stream
+void write_code(HuffEncoder *enc, CodeTable *table);
+
+// Write the code of a symbol to the stream
+int encode_symbol(HuffEncoder *enc, uint8_t symbol);
+
+// Write the last partial octet, padded with zeros
+void flush_encoder(HuffEncoder *enc);
+
+// Bit reader and decoding tree of one decoding stream
+typedef struct huff_decoder_t
+{
+  FILE *fp;         // input stream
+  uint8_t byte;     // current octet
+  uint8_t bit_idx;  // bits left in `byte`
+  Node *nodes;      // decoding tree, the root first
+  size_t num_nodes; // number of nodes in use
+} HuffDecoder;
+
+// Start a decoding stream with the codebook
+int init_decoder(HuffDecoder *dec, FILE *fp, CodeBook *book);
+
+// Read a bit from the stream (-1 at the end)
+int read_bit(HuffDecoder *dec);
+
+// Read the next symbol from the stream
+int decode_symbol(HuffDecoder *dec, uint8_t *symbol);
+
+// Drop the padding of the last octet, and free the decoding tree
+void finish_decoder(HuffDecoder *dec);
+
+/* ******************************************** */
+
 void compress(FILE *fp, Buffer *buf, CodeBook *book);
 
 CodeBook *read_codebook(FILE *fp);
 Buffer *read_bitdata(FILE *fp, uint64_t *len);
 
+/* ******************************************** */
+
+// Longest message encoded by the fast path in `main.c`
+#define SMALL_MSG_MAX 4096
+
+// Longest code the workspace emits (the width of `CodeTable.code`)
+#define MAX_CODE_BITS 32
+
+// Widest lookup table of the decoder, in bits (16 KiB of entries, so that it stays in the L1 cache)
+#define LUT_MAX_BITS 12
+
+// Default width of the lookup table
+#define LUT_BITS 10
+
+// Narrowest lookup table worth filling; shorter streams walk the tree
+#define LUT_MIN_BITS 6
+
+// Lookup table prefix that no code starts with
+#define LUT_INVALID 0xFFFF
+
+// Leaf of the code length computation
+typedef struct code_leaf_t
+{
+  size_t freqs;
+  uint32_t symbol;
+} CodeLeaf;
+
+// Code lengths of the symbols of `freqs[num_symbols]` into `lens` (0 if unused), none longer than MAX_CODE_BITS,
+// and return the number of used symbols; `leaves` has room for `num_symbols`, `weights` and `parents` for twice that
+uint32_t code_lengths(const size_t *freqs, uint32_t num_symbols, uint8_t *lens, CodeLeaf *leaves, size_t *weights,
+                      uint32_t *parents);
+
+// Canonical codes of the code lengths into `codes`, with the number of codes and the first code of each length into
+// `count[MAX_CODE_BITS + 1]` and `first[MAX_CODE_BITS + 1]`; fails if the lengths do not form a prefix code
+int canonical_codes(const uint8_t *lens, uint32_t num_symbols, uint32_t *codes, uint32_t *count, uint64_t *first);
+
+// Writer of codes MSB first, as `write_bit()` does
+typedef struct bit_packer_t
+{
+  uint8_t *p;   // next octet of the output
+  uint64_t acc; // pending bits, the last one lowest
+  uint8_t fill; // number of pending bits
+} BitPacker;
+
+// Append the `num_bits` bits of a code
+static inline void put_code(BitPacker *bp, uint32_t code, uint8_t num_bits)
+{
+  bp->acc = (bp->acc << num_bits) | code;
+  bp->fill += num_bits;
+  while (bp->fill >= 8)
+  {
+    bp->fill -= 8;
+    *bp->p++ = (uint8_t)(bp->acc >> bp->fill);
+  }
+}
+
+// Write out the last partial octet, and return the end of the output
+static inline uint8_t *flush_codes(BitPacker *bp)
+{
+  if (bp->fill)
+    *bp->p++ = (uint8_t)(bp->acc << (8 - bp->fill));
+  bp->fill = 0;
+  return bp->p;
+}
+
+// Entry of the decoder lookup table for the next bits of the stream
+typedef struct lut_entry_t
+{
+  uint16_t next;    // node in `Workspace.nodes` after the bits of a longer code (or LUT_INVALID)
+  uint8_t symbol;   // symbol of the code
+  uint8_t num_bits; // length of the code (0 if longer than the table)
+} LutEntry;
+
+// Scratch state of the allocation-free encoder, kept on the stack or by the caller
+typedef struct workspace_t
+{
+  size_t freqs[256];    // occurrences of each symbol
+  Node nodes[2 * 256];  // decoding tree, the root first
+  Node *root;           // root of the tree in `nodes`
+  CodeTable table[256]; // codetable indexed by the symbol
+  size_t num_symbols;   // number of unique symbols
+  uint64_t total_bits;  // length of the encoded message in bits
+
+  // Codebook section the decoding tree in `nodes` was built from
+  uint8_t book[sizeof(uint64_t) + 256 * (2 + sizeof(uint32_t))];
+  uint64_t book_len;
+
+  // Lookup table decoding up to `lut_bits` bits at a time (0 walks the tree bit by bit)
+  uint8_t lut_bits;
+  uint8_t lut_built; // width `lut` was built with for `book` (0 if none)
+  LutEntry lut[1 << LUT_MAX_BITS];
+} Workspace;
+
+// Shortest message counted on interleaved tables
+#define COUNT_INTERLEAVE_MIN 2048
+
+// Count the occurrences of each symbol of a message into `freqs[256]`
+void count_symbols(size_t *freqs, const uint8_t *msg, uint64_t len);
+
+// Build the codetables of a message inside the workspace
+int build_workspace(Workspace *ws, const uint8_t *msg, uint64_t len);
+
+// Exact size of the stream `encode_small()` writes for a built workspace
+uint64_t encoded_size(Workspace *ws);
+
+// Write the stream of a message built by `build_workspace()` into `out`, and return the written length (0 on failure)
+uint64_t encode_workspace(Workspace *ws, const uint8_t *msg, uint64_t len, uint8_t *out, uint64_t capacity);
+
+// Encode a message into `out` without heap allocation, and return the written length (0 on failure)
+uint64_t encode_small(Workspace *ws, const uint8_t *msg, uint64_t len, uint8_t *out, uint64_t capacity);
+
+// Read the original length of an encoded stream
+int peek_length(const uint8_t *in, uint64_t size, uint64_t *len);
+
+// Decode a stream written by `encode_small()` into `out`, reusing the decoding tree if the codebook is unchanged
+int decode_small(Workspace *ws, const uint8_t *in, uint64_t size, uint8_t *out, uint64_t capacity, uint64_t *len);
+
+// Shortest bitstream chunk given to a speculative decoder, in bits
+#define SPEC_MIN_CHUNK ((uint64_t)1 << 16)
+
+// Fewest chunks worth decoding speculatively rather than in one pass
+#define SPEC_MIN_THREADS 2
+
+// Decode a stream written by `encode_small()` on `num_threads` threads, each starting at an arbitrary bit of the
+// bitstream and resynchronized with its predecessor afterward
+int decode_speculative(Workspace *ws, const uint8_t *in, uint64_t size, uint8_t *out, uint64_t capacity, uint64_t *len,
+                       int num_threads);
+
+/* ******************************************** */
+
+#define ARCHIVE_SIGN "HUFFBLKS"
+#define ARCHIVE_SIGN_LEN (strlen(ARCHIVE_SIGN))
+
+// The block carries its own codebook, instead of reusing the previous one
+#define BLOCK_BOOK 0x01
+
+// Transforms applied to the block before the coder (see `transform.h`)
+#define BLOCK_BWT 0x02     // Burrows-Wheeler transform
+#define BLOCK_MTF 0x04     // move-to-front
+#define BLOCK_RLE 0x08     // zero-run length encoding
+#define BLOCK_DELTA 0x10   // delta of octets
+#define BLOCK_DELTA16 0x20 // delta of 16-bit words
+#define BLOCK_TRANSFORMS (BLOCK_BWT | BLOCK_MTF | BLOCK_RLE | BLOCK_DELTA | BLOCK_DELTA16)
+
+// Alphabets wider than an octet (see `wide.h`); such blocks always carry their own codebook,
+// prefixed with its length (8 octets), and the blocks after them do not reuse it
+#define BLOCK_SYM16 0x40 // 16-bit words
+#define BLOCK_WORDS 0x80 // octets and dictionary tokens
+#define BLOCK_WIDE (BLOCK_SYM16 | BLOCK_WORDS)
+
+// Extra cost of the old codebook tolerated by an append, relative to a fresh one
+#define REUSE_THRESHOLD 0.02
+
+// Header of a block in the archive (flags, original length, number of bits, and
+// the coded length and BWT row if transformed)
+typedef struct block_t
+{
+  uint8_t flags;        // BLOCK_* flags
+  uint64_t len;         // original length in octets
+  uint64_t num_bits;    // length of the bitstream in bits
+  uint64_t coded_len;   // length of the transformed octets the bitstream codes
+  uint64_t primary;     // row of the original in the BWT
+  uint64_t book_offset; // offset of the codebook the block is encoded with
+  uint64_t book_len;    // length of that codebook
+  uint64_t offset;      // offset of the bitstream
+} Block;
+
+// How the input is split into blocks
+#define SPLIT_FIXED 0   // blocks of `block_size` octets
+#define SPLIT_GREEDY 1  // close a block when the next window is cheaper with its own codebook
+#define SPLIT_OPTIMAL 2 // cheapest window-aligned split
+
+// Granularity of the adaptive split
+#define SPLIT_WINDOW 4096
+
+// Most windows of an optimal split; longer inputs get wider windows
+#define SPLIT_MAX_WINDOWS 1024
+
+// Settings of the archive writer
+typedef struct archive_opts_t
+{
+  double threshold;     // extra cost of the old codebook tolerated when appending
+  uint64_t block_size;  // octets per block (0 for a single block), or per window if adaptive
+  int split;            // SPLIT_* strategy
+  uint8_t transforms;   // BLOCK_* transforms of the new blocks
+  bool auto_transforms; // pick the cheapest transforms of each block instead
+  int num_threads;      // threads transforming or decoding the blocks
+  uint8_t table_bits;   // width of the decoder lookup table (0 walks the tree)
+  uint8_t symbols;      // BLOCK_SYM16 or BLOCK_WORDS alphabet of the new blocks (0 for octets)
+  uint32_t num_tokens;  // most dictionary tokens of BLOCK_WORDS
+} ArchiveOpts;
+
+// Estimated bits of a block of `num` octets with its own codebook, from its histogram
+double hist_cost(size_t *freqs, uint64_t num);
+
+// Choose the block lengths of a message, and return the number of blocks
+uint64_t plan_blocks(const uint8_t *msg, uint64_t len, const ArchiveOpts *opts, uint64_t **lens);
+
+// Read the block headers of an archive, skipping over the bitstreams
+Block *read_blocks(FILE *fp, uint64_t *num_blocks);
+
+// Write a block of `blk->coded_len` symbols encoded with the codetables of the workspace
+int write_block(FILE *fp, Workspace *ws, Block *blk, const uint8_t *coded);
+
+// Append blocks to an archive, reusing the last codebook unless it costs more than `opts->threshold` over a fresh one
+int append_archive(FILE *fp, const uint8_t *msg, uint64_t len, const ArchiveOpts *opts);
+
+// Decode all the blocks of an archive
+Buffer *read_archive(FILE *fp);
+
+// Receiver of the decoded data, in order
+typedef int (*BlockSink)(const uint8_t *data, uint64_t len, void *arg);
+
+// Decode the blocks of an archive on `opts->num_threads` threads, handing each completed prefix to the sink (if any)
+Buffer *decode_archive(FILE *fp, const ArchiveOpts *opts, BlockSink sink, void *arg);
+
+// Receiver of the offsets of the matches, in increasing order
+typedef int (*MatchSink)(uint64_t offset, void *arg);
+
+// Find every occurrence of a pattern in an archive or a stream written by `encode()`, matching the codes of the
+// pattern against each bitstream, and return the number of matches (-1 on failure)
+int64_t search_archive(FILE *fp, const uint8_t *pattern, uint64_t len, uint8_t table_bits, MatchSink sink, void *arg);
+
+/* ******************************************** */
+
+// Size of a block predicted without encoding it
+typedef struct analysis_t
+{
+  uint64_t len;           // original length in octets
+  double entropy;         // Shannon entropy in bits per symbol
+  uint64_t total_bits;    // length of the bitstream in bits
+  uint64_t header_bytes;  // block header and codebook in the archive
+  uint64_t payload_bytes; // bitstream in the archive
+  bool fresh_book;        // whether the block stores its own codebook
+} Analysis;
+
+// Predict the compressed size of a block from its histogram and code lengths, reusing the codebook `old` (if any)
+// the way an append would; the code lengths the block is written with are left in `ws->table`
+int analyze_block(Workspace *ws, const uint8_t *msg, uint64_t len, uint8_t transforms, CodeTable *old,
+                  double threshold, Analysis *stats);
+
 #endif // __HUFFMAN_H__
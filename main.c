@@ -1,38 +1,78 @@
 #include "huffman.h"
+#include "daemon.h"
+#include "transform.h"
+#include "tune.h"
+#include "wide.h"
 
 #include <getopt.h>
+#include <unistd.h>
 
 /*
  * Main script for Huffman Code
  *
  * Usage:
- *  1. Build with the helpper script (E.g. `gcc main.c huffman.c -o huffman`)
+ *  1. Build with the helpper script (E.g. `gcc main.c huffman.c daemon.c transform.c tune.c wide.c -o huffman -pthread -lm`)
  *  2. Run the script with the options (E.g. `./huffman -m AAAABCCCDDE`)
+ *  3. Or keep a daemon running (E.g. `./huffman -D /tmp/huffman.sock &`),
+ *     and let it do the work (E.g. `./huffman -c /tmp/huffman.sock -m AAAABCCCDDE`)
  */
 
 static void usage(const char *progname);
 void encode(FILE *fp, Buffer *buf);
+void encode_message(FILE *fp, const char *message);
 void decode(FILE *fp, bool save);
+int request_daemon(const char *path, Buffer *buf, const char *binfile, bool save);
+int append_input(const char *path, Buffer *buf, const ArchiveOpts *opts);
+int extract_archive(const char *path, const ArchiveOpts *opts, bool save);
+int search_input(const char *path, const char *pattern, const ArchiveOpts *opts);
+void show_output(const uint8_t *data, uint64_t len, bool save);
+void analyze_input(Buffer *buf, const ArchiveOpts *opts);
+int parse_transforms(const char *list);
+void print_transforms(uint8_t flags);
+int parse_symbols(const char *arg, ArchiveOpts *opts);
+int tune_opts(const uint8_t *msg, uint64_t len, const char *cache_path, ArchiveOpts *opts, int num_threads);
 
 // Command line options
-static const struct option options[4] = {
+static const struct option options[] = {
     {.name = "input", .has_arg = required_argument, .flag = NULL, .val = 'i'},
     {.name = "message", .has_arg = required_argument, .flag = NULL, .val = 'm'},
     {.name = "save", .has_arg = no_argument, .flag = NULL, .val = 's'},
+    {.name = "analyze", .has_arg = no_argument, .flag = NULL, .val = 'A'},
+    {.name = "block-size", .has_arg = required_argument, .flag = NULL, .val = 'b'},
+    {.name = "split", .has_arg = required_argument, .flag = NULL, .val = 'S'},
+    {.name = "transform", .has_arg = required_argument, .flag = NULL, .val = 't'},
+    {.name = "symbols", .has_arg = required_argument, .flag = NULL, .val = 'w'},
+    {.name = "append", .has_arg = required_argument, .flag = NULL, .val = 'a'},
+    {.name = "extract", .has_arg = required_argument, .flag = NULL, .val = 'x'},
+    {.name = "find", .has_arg = required_argument, .flag = NULL, .val = 'f'},
+    {.name = "threads", .has_arg = required_argument, .flag = NULL, .val = 'T'},
+    {.name = "auto", .has_arg = optional_argument, .flag = NULL, .val = 'u'},
+    {.name = "daemon", .has_arg = required_argument, .flag = NULL, .val = 'D'},
+    {.name = "connect", .has_arg = required_argument, .flag = NULL, .val = 'c'},
     {.name = "help", .has_arg = optional_argument, .flag = NULL, .val = 'h'},
+    {0},
 };
 
 int main(int argc, char *const argv[])
 {
   FILE *fp;
-  Buffer *buf;
+  Buffer *buf = NULL;
   int opt, idx;
-  char const *infile, *message;
+  char const *infile = NULL, *message = NULL;
   char const *binfile = "out.bin";
-  bool save = false;
+  char const *daemon_path = NULL, *connect_path = NULL, *append_path = NULL, *extract_path = NULL;
+  char const *cache_path = NULL, *pattern = NULL;
+  bool save = false, analyze = false, tune = false;
+  ArchiveOpts opts = {
+      .threshold = REUSE_THRESHOLD,
+      .num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN),
+      .table_bits = LUT_BITS,
+      .num_tokens = DICT_TOKENS,
+  };
+  int transforms, num_threads = 0;
 
   // Parse command line arguments if given
-  while ((opt = getopt_long(argc, argv, "i:m:sh", options, &idx)) != -1)
+  while ((opt = getopt_long(argc, argv, "i:m:sAb:S:t:w:a:x:f:T:u::D:c:h", options, &idx)) != -1)
   {
     switch (opt)
     {
@@ -45,6 +85,62 @@ int main(int argc, char *const argv[])
     case 's':
       save = true;
       break;
+    case 'A':
+      analyze = true;
+      break;
+    case 'b':
+      opts.block_size = strtoull(optarg, NULL, 0);
+      break;
+    case 'S':
+      if (!strcmp(optarg, "greedy"))
+        opts.split = SPLIT_GREEDY;
+      else if (!strcmp(optarg, "optimal"))
+        opts.split = SPLIT_OPTIMAL;
+      else
+      {
+        usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 't':
+      opts.auto_transforms = !strcmp(optarg, "auto");
+      transforms = opts.auto_transforms ? 0 : parse_transforms(optarg);
+      if (transforms < 0)
+      {
+        usage(argv[0]);
+        return -1;
+      }
+      opts.transforms = (uint8_t)transforms;
+      break;
+    case 'w':
+      if (parse_symbols(optarg, &opts))
+      {
+        usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'a':
+      append_path = optarg;
+      break;
+    case 'x':
+      extract_path = optarg;
+      break;
+    case 'f':
+      pattern = optarg;
+      break;
+    case 'T':
+      num_threads = atoi(optarg);
+      break;
+    case 'u':
+      tune = true;
+      cache_path = optarg;
+      break;
+    case 'D':
+      daemon_path = optarg;
+      break;
+    case 'c':
+      connect_path = optarg;
+      break;
     case 'h':
       usage(argv[0]);
       return 0;
@@ -55,6 +151,34 @@ int main(int argc, char *const argv[])
     }
   }
 
+  if (num_threads > 0)
+    opts.num_threads = num_threads;
+
+  // Only archive blocks are coded with wide alphabets, and extracting reads the alphabet from the blocks
+  if (opts.symbols && (!(append_path || analyze) || extract_path || daemon_path || connect_path))
+  {
+    fprintf(stderr, "[Error]\t-w 16 and -w words only apply with -a or -A\n");
+    return -1;
+  }
+
+  // Nothing to sample when serving or extracting, so only the cache is used
+  if (tune && (daemon_path || extract_path))
+  {
+    if (tune_opts(NULL, 0, cache_path, &opts, num_threads))
+      printf("[Info]\tNo cached tuning, keeping the defaults\n");
+    else
+      num_threads = opts.num_threads;
+  }
+
+  if (daemon_path)
+    return run_daemon(daemon_path, (num_threads > 0) ? num_threads : DAEMON_WORKERS);
+
+  if (extract_path && pattern)
+    return search_input(extract_path, pattern, &opts);
+
+  if (extract_path)
+    return extract_archive(extract_path, &opts, save);
+
   if (infile)
   {
     printf("[Info]\tReading '%s'\n", infile);
@@ -66,6 +190,11 @@ int main(int argc, char *const argv[])
       return -1;
     fclose(fp);
   }
+  else if (message && strlen(message) <= SMALL_MSG_MAX && !connect_path && !append_path && !analyze)
+  {
+    // Short messages are encoded on the stack below
+    printf("[Info]\tReading message\n");
+  }
   else if (message)
   {
     printf("[Info]\tReading message\n");
@@ -79,11 +208,38 @@ int main(int argc, char *const argv[])
     return -1;
   }
 
+  if (tune && buf && tune_opts(buf->buffer, buf->len, cache_path, &opts, num_threads))
+    fprintf(stderr, "[Error]\tFailed to tune, keeping the defaults\n");
+
+  if (analyze)
+  {
+    analyze_input(buf, &opts);
+    del_buffer(buf);
+    return 0;
+  }
+
+  if (append_path)
+  {
+    int ret = append_input(append_path, buf, &opts);
+    del_buffer(buf);
+    return ret;
+  }
+
+  if (connect_path)
+  {
+    int ret = request_daemon(connect_path, buf, binfile, save);
+    del_buffer(buf);
+    return ret;
+  }
+
   // Encode
   fp = fopen(binfile, "wb");
   if (mem_check(fp, "fp"))
     return -1;
-  encode(fp, buf);
+  if (buf)
+    encode(fp, buf);
+  else
+    encode_message(fp, message);
   putchar('\n');
   fclose(fp);
 
@@ -111,6 +267,41 @@ static void usage(const char *progname)
   printf("      Specify the message to encode.\n");
   printf("  -s, --save\n");
   printf("      Save the decoded file.\n");
+  printf("  -A, --analyze\n");
+  printf("      Predict the size of a new archive of the input without writing any output.\n");
+  printf("  -b, --block-size=OCTETS\n");
+  printf("      Split the input in blocks of this size. (Default: whole input, or %llu with\n",
+         (unsigned long long)BWT_BLOCK_SIZE);
+  printf("      'bwt' or 'auto' transforms)\n");
+  printf("  -S, --split=MODE\n");
+  printf("      Split the input where statistics change, in 'greedy' or 'optimal' mode,\n");
+  printf("      on windows of the block size. (Default window: %d, widened by 'optimal' to\n", SPLIT_WINDOW);
+  printf("      at most %d windows)\n", SPLIT_MAX_WINDOWS);
+  printf("  -t, --transform=LIST\n");
+  printf("      Transform the blocks before coding, with a comma-separated list of\n");
+  printf("      'delta', 'delta16', 'bwt', 'mtf' and 'rle' (E.g. `-t bwt,mtf,rle`), or with 'auto',\n");
+  printf("      the smallest of a few of these lists for each block. With 'bwt' or 'auto', blocks\n");
+  printf("      of an adaptive split are cut to at most %llu octets.\n", (unsigned long long)BWT_BLOCK_SIZE);
+  printf("  -w, --symbols=ALPHABET\n");
+  printf("      Code the blocks as '8'-bit octets, '16'-bit words, or 'words[:K]', octets and\n");
+  printf("      the K most profitable words of the block as tokens. Only with -a or -A.\n");
+  printf("      (Default: 8, K: %d)\n", DICT_TOKENS);
+  printf("  -a, --append=ARCHIVE\n");
+  printf("      Append the input to the archive as new blocks. (Decode it with -x)\n");
+  printf("  -x, --extract=ARCHIVE\n");
+  printf("      Decode the archive, or a file written without -a.\n");
+  printf("  -f, --find=PATTERN\n");
+  printf("      With -x, print the offset of every occurrence of the pattern instead of decoding.\n");
+  printf("  -T, --threads=N\n");
+  printf("      Number of threads transforming, decoding or serving. (Default: all cores,\n");
+  printf("      or %d workers with -D)\n", DAEMON_WORKERS);
+  printf("  -u, --auto[=CACHE]\n");
+  printf("      Calibrate the block size, threads and decoder table on a sample of the input,\n");
+  printf("      reusing the settings of the cache file if given. -b and -T still apply.\n");
+  printf("  -D, --daemon=SOCKET\n");
+  printf("      Serve compress/decompress requests on the unix domain socket.\n");
+  printf("  -c, --connect=SOCKET\n");
+  printf("      Let the daemon on the socket encode and decode the input.\n");
   printf("  -h, --help\n");
   printf("      Display this help and exit.\n");
   printf("\n");
@@ -132,7 +323,7 @@ void encode(FILE *fp, Buffer *buf)
   tree = build_tree(tree);
 
   CodeBook *book = tree2book(tree);
-  for (uint8_t i = 0; i < tree->num_symbols; i++)
+  for (size_t i = 0; i < tree->num_symbols; i++)
     print_table(book->table[i]);
 
   // Write to file
@@ -143,13 +334,38 @@ void encode(FILE *fp, Buffer *buf)
   del_tree(tree);
 }
 
+void encode_message(FILE *fp, const char *message)
+{
+  // Signature and codebook fit in 2 KiB, and codes of a short message stay under 32 bits
+  uint8_t out[2048 + SMALL_MSG_MAX * sizeof(uint32_t)];
+  Workspace ws;
+
+  uint64_t len = strlen(message);
+  uint64_t size = encode_small(&ws, (const uint8_t *)message, len, out, sizeof(out));
+  if (!size)
+  {
+    fprintf(stderr, "[Error]\tFailed to encode the message\n");
+    return;
+  }
+
+  fwrite(out, sizeof(uint8_t), size, fp);
+
+  // Show the statistics
+  printf("[Info]\tEncoded %zu symbols into %llu octets\n", ws.num_symbols, (unsigned long long)size);
+  putchar('\n');
+  double avg = len ? (double)ws.total_bits / (double)len : 0.0;
+  printf("Average: %.2f [bits/symbol]\n", avg);
+  printf("Compression ratio: %.1f%% ", (100 * avg / 8.0));
+  printf("(In case all inputs are 8-bit)\n");
+}
+
 void decode(FILE *fp, bool save)
 {
   // Read the compression info
   uint8_t byte; // Temporary octet storage
 
-  // Read the number of symbols
-  uint8_t *sign = (uint8_t *)malloc(sizeof(uint8_t));
+  // Read the signature
+  uint8_t sign[8];
   fread(sign, sizeof(uint8_t), FILE_SIGN_LEN, fp);
 
   // Check the signature
@@ -158,7 +374,6 @@ void decode(FILE *fp, bool save)
     fprintf(stderr, "[Error]\tInvalid signature\n");
     return;
   }
-  free(sign);
 
   // Read codebook
   CodeBook *book = read_codebook(fp);
@@ -185,34 +400,24 @@ void decode(FILE *fp, bool save)
   byte = 0x00;
 
   // Decompress the data
-  uint32_t bits = 0;
-  uint8_t bit_count = 0;
-  size_t data_len = 0;
-  uint8_t data[origin_len];
-  while (fread(&byte, sizeof(uint8_t), 1, fp) == 1)
-  {
-    if (byte == GROUP_SEPARATOR)
-      break;
-
-    for (int i = 7; 0 <= i; i--)
-    {
-      uint32_t mask = 1 << i;
-      uint32_t bit_i = (byte & mask) >> i;
+  HuffDecoder dec;
+  if (init_decoder(&dec, fp, book))
+    return;
 
-      bits <<= 1;
-      bits |= bit_i;
-      bit_count++;
+  size_t data_len = 0;
+  uint8_t *data = (uint8_t *)malloc(origin_len + 1);
+  if (mem_check(data, "data"))
+    return;
+  while (data_len < origin_len && !decode_symbol(&dec, &data[data_len]))
+    data_len++;
+  finish_decoder(&dec);
 
-      CodeTable *table = search_code(book, bits, bit_count);
-      if (table)
-      {
-        // printf("%c %s\n", table->symbol, bitstr(bits, bit_count));
-        data[data_len] = table->symbol;
-        data_len++;
-        bits = 0;
-        bit_count = 0;
-      }
-    }
+  // Check if the data is finished
+  fread(&byte, sizeof(uint8_t), 1, fp);
+  if (data_len != origin_len || byte != GROUP_SEPARATOR)
+  {
+    fprintf(stderr, "[Error]\tInvalid data\n");
+    return;
   }
 
   // Read the data length in bits
@@ -227,15 +432,380 @@ void decode(FILE *fp, bool save)
   }
 
   // Write the data
+  show_output(data, data_len, save);
+
+  free(data);
+  del_codebook(book);
+}
+
+int request_daemon(const char *path, Buffer *buf, const char *binfile, bool save)
+{
+  int fd = daemon_connect(path);
+  if (fd < 0)
+    return -1;
+
+  int ret = -1;
+  FILE *fp = NULL;
+  Buffer *enc = new_buffer(BUFSIZ);
+  Buffer *dec = new_buffer(BUFSIZ);
+  if (mem_check(enc, "enc") || mem_check(dec, "dec"))
+    goto done;
+
+  // Encode
+  if (daemon_request(fd, DAEMON_COMPRESS, buf->buffer, buf->len, enc))
+  {
+    fprintf(stderr, "[Error]\tThe daemon failed to encode\n");
+    goto done;
+  }
+
+  fp = fopen(binfile, "wb");
+  if (mem_check(fp, "fp"))
+    goto done;
+  fwrite(enc->buffer, sizeof(uint8_t), enc->len, fp);
+  fclose(fp);
+  printf("[Info]\tWrote %llu octets to '%s'\n", (unsigned long long)enc->len, binfile);
+
+  // Decode
+  if (daemon_request(fd, DAEMON_DECOMPRESS, enc->buffer, enc->len, dec))
+  {
+    fprintf(stderr, "[Error]\tThe daemon failed to decode\n");
+    goto done;
+  }
+
+  show_output(dec->buffer, dec->len, save);
+  ret = 0;
+
+done:
+  close(fd);
+  del_buffer(enc);
+  del_buffer(dec);
+  return ret;
+}
+
+int append_input(const char *path, Buffer *buf, const ArchiveOpts *opts)
+{
+  // Create the archive if it does not exist yet
+  FILE *fp = fopen(path, "r+b");
+  if (!fp)
+    fp = fopen(path, "w+b");
+  if (mem_check(fp, "fp"))
+    return -1;
+
+  // Only the new blocks are written, so the archive is not decoded again
+  int ret = append_archive(fp, buf->buffer, buf->len, opts);
+  fclose(fp);
+  if (!ret)
+    printf("[Info]\tAppended %llu octets to '%s'\n", (unsigned long long)buf->len, path);
+  return ret;
+}
+
+// Write the decoded prefix of an archive to the file
+static int write_sink(const uint8_t *data, uint64_t len, void *arg)
+{
+  return (fwrite(data, sizeof(uint8_t), len, (FILE *)arg) == len) ? 0 : -1;
+}
+
+// Decode a whole stream written by `encode()` with the speculative decoder
+static int extract_stream(FILE *fp, const ArchiveOpts *opts, bool save)
+{
+  fseek(fp, 0, SEEK_END);
+  uint64_t size = (uint64_t)ftell(fp);
+  rewind(fp);
+
+  uint64_t len;
+  uint8_t *in = (uint8_t *)malloc(size + 1);
+  if (mem_check(in, "in"))
+    return -1;
+  if (fread(in, sizeof(uint8_t), size, fp) != size || peek_length(in, size, &len))
+  {
+    fprintf(stderr, "[Error]\tInvalid file format\n");
+    free(in);
+    return -1;
+  }
+
+  uint8_t *data = (uint8_t *)malloc(len + 1);
+  Workspace *ws = (Workspace *)malloc(sizeof(Workspace));
+  if (mem_check(data, "data") || mem_check(ws, "ws"))
+    return -1;
+  ws->book_len = 0;
+  ws->lut_bits = opts->table_bits;
+
+  int ret = decode_speculative(ws, in, size, data, len, &len, opts->num_threads);
+  if (ret)
+    fprintf(stderr, "[Error]\tInvalid data\n");
+  else
+    show_output(data, len, save);
+
+  free(ws);
+  free(data);
+  free(in);
+  return ret;
+}
+
+int extract_archive(const char *path, const ArchiveOpts *opts, bool save)
+{
+  FILE *out = NULL;
+
+  printf("[Info]\tReading '%s' with %d threads\n", path, opts->num_threads);
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return -1;
+
+  // Single bitstreams of the old format are split speculatively instead
+  uint8_t sign[8] = {0};
+  if (fread(sign, sizeof(uint8_t), FILE_SIGN_LEN, fp) == FILE_SIGN_LEN && !memcmp(sign, FILE_SIGN, FILE_SIGN_LEN))
+  {
+    int ret = extract_stream(fp, opts, save);
+    fclose(fp);
+    return ret;
+  }
+  rewind(fp);
+
+  // Saved data is streamed as the blocks complete
+  if (save)
+  {
+    printf("[Info]\tWriting to 'out.txt'\n");
+    out = fopen("out.txt", "w");
+    if (mem_check(out, "out"))
+      return -1;
+  }
+
+  Buffer *buf = decode_archive(fp, opts, save ? write_sink : NULL, out);
+  fclose(fp);
+  if (out)
+    fclose(out);
+  if (!buf)
+    return -1;
+
+  if (!save)
+    show_output(buf->buffer, buf->len, save);
+  del_buffer(buf);
+  return 0;
+}
+
+// Print the offset of a match
+static int print_match(uint64_t offset, void *arg)
+{
+  (void)arg;
+  printf("%llu\n", (unsigned long long)offset);
+  return 0;
+}
+
+int search_input(const char *path, const char *pattern, const ArchiveOpts *opts)
+{
+  printf("[Info]\tSearching '%s' for '%s'\n", path, pattern);
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return -1;
+
+  int64_t matches = search_archive(fp, (const uint8_t *)pattern, strlen(pattern), opts->table_bits, print_match, NULL);
+  fclose(fp);
+  if (matches < 0)
+    return -1;
+
+  printf("[Info]\tFound %lld matches\n", (long long)matches);
+  return 0;
+}
+
+void show_output(const uint8_t *data, uint64_t len, bool save)
+{
   if (save)
   {
     FILE *out = fopen("out.txt", "w");
     printf("[Info]\tWriting to 'out.txt'\n");
-    fwrite(data, sizeof(uint8_t), data_len, out);
+    fwrite(data, sizeof(uint8_t), len, out);
     fclose(out);
   }
   else
-    printf("\n>>> %s\n", data);
+    printf("\n>>> %.*s\n", (int)len, data);
+}
 
-  del_codebook(book);
+void analyze_input(Buffer *buf, const ArchiveOpts *opts)
+{
+  Analysis total = {0};
+  CodeTable old[256];
+  bool have_old = false;
+  Workspace *ws = (Workspace *)malloc(sizeof(Workspace));
+  WideCoder *wc = opts->symbols ? new_wide_coder(opts->table_bits) : NULL;
+  if (mem_check(ws, "ws") || (opts->symbols && !wc))
+    return;
+
+  uint64_t *lens;
+  uint64_t num_blocks = plan_blocks(buf->buffer, buf->len, opts, &lens);
+
+  for (uint64_t pos = 0, idx = 0; idx < num_blocks; pos += lens[idx++])
+  {
+    Analysis stats;
+    uint64_t len = lens[idx];
+
+    // The transforms an append would pick for the block
+    ArchiveOpts block_opts = *opts;
+    if (opts->auto_transforms)
+    {
+      TransformTask task = {.in = buf->buffer + pos, .len = len};
+      if (choose_transforms(&task))
+        break;
+      free(task.out);
+      block_opts.transforms = task.flags;
+    }
+
+    // Wide alphabets are too large to list
+    if (wc)
+    {
+      if (analyze_wide(wc, BLOCK_BOOK | opts->symbols, buf->buffer + pos, len, &block_opts, &stats))
+        break;
+
+      putchar('\n');
+      printf("[Info]\tBlock %llu: %llu octets\n", (unsigned long long)idx, (unsigned long long)len);
+      printf("Symbols: %llu coded, %u used of %u", (unsigned long long)wc->num_coded, wc->num_used, wc->num_symbols);
+      if (opts->symbols & BLOCK_WORDS)
+        printf(" (%u tokens)", wc->num_tokens);
+      putchar('\n');
+    }
+    else
+    {
+      // Each block may reuse the codebook of the previous one, as when appending
+      if (analyze_block(ws, buf->buffer + pos, len, block_opts.transforms, have_old ? old : NULL, opts->threshold,
+                        &stats))
+        break;
+      memcpy(old, ws->table, sizeof(old));
+      have_old = true;
+
+      putchar('\n');
+      printf("[Info]\tBlock %llu: %llu octets, %s codebook\n", (unsigned long long)idx, (unsigned long long)len,
+             stats.fresh_book ? "fresh" : "reused");
+      for (unsigned s = 0; s < 256; s++)
+        if (ws->freqs[s])
+          printf("\t{%#x: %zu times, %u bits}\n", s, ws->freqs[s], ws->table[s].num_bits);
+    }
+
+    uint64_t size = stats.header_bytes + stats.payload_bytes;
+    if (opts->auto_transforms)
+      print_transforms(block_opts.transforms);
+    printf("Entropy: %.3f [bits/symbol]\n", stats.entropy);
+    printf("Average: %.3f [bits/symbol]\n", (double)stats.total_bits / (double)len);
+    printf("Size: %llu octets (header %llu + payload %llu)\n", (unsigned long long)size,
+           (unsigned long long)stats.header_bytes, (unsigned long long)stats.payload_bytes);
+    printf("Compression ratio: %.1f%%\n", 100.0 * (double)size / (double)len);
+
+    total.len += len;
+    total.entropy += stats.entropy * (double)len;
+    total.header_bytes += stats.header_bytes;
+    total.payload_bytes += stats.payload_bytes;
+  }
+
+  // Whole archive, including the signature
+  uint64_t size = ARCHIVE_SIGN_LEN + total.header_bytes + total.payload_bytes;
+  putchar('\n');
+  printf("Total: %llu octets into %llu octets\n", (unsigned long long)total.len, (unsigned long long)size);
+  if (total.len)
+  {
+    printf("Entropy: %.3f [bits/symbol]\n", total.entropy / (double)total.len);
+    printf("Compression ratio: %.1f%%\n", 100.0 * (double)size / (double)total.len);
+  }
+
+  free(lens);
+  del_wide_coder(wc);
+  free(ws);
+}
+
+// Names of the transforms of `-t`
+static const struct
+{
+  const char *name;
+  uint8_t flag;
+} names[] = {
+    {"delta", BLOCK_DELTA},
+    {"delta16", BLOCK_DELTA16},
+    {"bwt", BLOCK_BWT},
+    {"mtf", BLOCK_MTF},
+    {"rle", BLOCK_RLE},
+};
+
+void print_transforms(uint8_t flags)
+{
+  printf("Transforms: ");
+  if (!flags)
+    printf("none");
+  for (size_t i = 0, n = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    if (flags & names[i].flag)
+      printf("%s%s", n++ ? "," : "", names[i].name);
+  putchar('\n');
+}
+
+int parse_transforms(const char *list)
+{
+  int flags = 0;
+
+  while (*list)
+  {
+    size_t len = strcspn(list, ",");
+    size_t i;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+      if (strlen(names[i].name) == len && !strncmp(list, names[i].name, len))
+        break;
+
+    if (i == sizeof(names) / sizeof(names[0]))
+    {
+      fprintf(stderr, "[Error]\tUnknown transform: %.*s\n", (int)len, list);
+      return -1;
+    }
+
+    flags |= names[i].flag;
+    list += len + (list[len] == ',');
+  }
+  return flags;
+}
+
+int parse_symbols(const char *arg, ArchiveOpts *opts)
+{
+  if (!strcmp(arg, "8"))
+    opts->symbols = 0;
+  else if (!strcmp(arg, "16"))
+    opts->symbols = BLOCK_SYM16;
+  else if (!strncmp(arg, "words", 5) && (arg[5] == '\0' || arg[5] == ':'))
+  {
+    opts->symbols = BLOCK_WORDS;
+    if (arg[5] == ':')
+    {
+      char *end;
+      unsigned long num = strtoul(arg + 6, &end, 0);
+      if (*end || end == arg + 6 || num > DICT_MAX_TOKENS)
+      {
+        fprintf(stderr, "[Error]\tInvalid number of tokens: %s\n", arg + 6);
+        return -1;
+      }
+      opts->num_tokens = (uint32_t)num;
+    }
+  }
+  else
+  {
+    fprintf(stderr, "[Error]\tUnknown alphabet: %s\n", arg);
+    return -1;
+  }
+  return 0;
+}
+
+int tune_opts(const uint8_t *msg, uint64_t len, const char *cache_path, ArchiveOpts *opts, int num_threads)
+{
+  Tuning tuning;
+  uint64_t block_size = opts->block_size;
+
+  if (auto_tune(msg, len, cache_path, opts, &tuning))
+    return -1;
+
+  // Settings of the command line win
+  if (block_size)
+    opts->block_size = block_size;
+  if (num_threads > 0)
+    opts->num_threads = num_threads;
+
+  if (tuning.cached)
+    printf("[Info]\tTuning read from '%s'\n", cache_path);
+  else
+    printf("[Info]\tTuned in %.3f seconds\n", tuning.seconds);
+  printf("[Info]\tBlock size: %llu octets\n", (unsigned long long)opts->block_size);
+  printf("[Info]\tThreads: %d\n", opts->num_threads);
+  printf("[Info]\tDecoder table: %u bits\n", opts->table_bits);
+  return 0;
 }
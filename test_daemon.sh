@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Round trip of messages through a local daemon
+#
+# Usage: ./test_daemon.sh [BINARY]  (Default: builds one in a temporary directory)
+
+set -u
+
+DIR=$(mktemp -d)
+BIN=${1:-$DIR/huffman}
+SOCK="$DIR/huffman.sock"
+PID=
+
+cleanup()
+{
+  [ -n "$PID" ] && kill "$PID" 2>/dev/null
+  rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail()
+{
+  echo "[Error]	$1"
+  exit 1
+}
+
+if [ $# -eq 0 ]; then
+  gcc -O2 main.c huffman.c daemon.c transform.c tune.c wide.c -o "$BIN" -pthread -lm || fail "Build failed"
+fi
+BIN=$(cd "$(dirname "$BIN")" && pwd)/$(basename "$BIN")
+
+# Anything but a socket at the path is left alone
+touch "$SOCK"
+"$BIN" -D "$SOCK" >/dev/null 2>&1 && fail "The daemon replaced a regular file"
+[ -f "$SOCK" ] || fail "The regular file was removed"
+rm -f "$SOCK"
+
+"$BIN" -D "$SOCK" -T 2 >"$DIR/daemon.log" 2>&1 &
+PID=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -S "$SOCK" ] && break
+  sleep 0.2
+done
+[ -S "$SOCK" ] || fail "The daemon did not start"
+
+# Short and long messages, each on a fresh connection
+cd "$DIR"
+for msg in "AAAABCCCDDE" "the quick brown fox jumps over the lazy dog" "$(seq 1 2000 | tr '\n' ' ')"; do
+  for client in 1 2 3; do
+    "$BIN" -c "$SOCK" -m "$msg" -s >/dev/null 2>&1 || fail "Request failed"
+    [ "$(cat out.txt)" = "$msg" ] || fail "Round trip differs: $msg"
+  done
+done
+
+# A shut down daemon removes its socket
+kill -TERM "$PID"
+wait "$PID" || fail "The daemon failed on shutdown"
+PID=
+[ -e "$SOCK" ] && fail "The socket was left behind"
+
+echo "[Info]	Daemon round trips passed"
@@ -0,0 +1,430 @@
+#include "transform.h"
+
+#include <pthread.h>
+
+// Transforms tried on each block by `choose_transforms()`
+static const uint8_t candidates[] = {
+    0,
+    BLOCK_DELTA,
+    BLOCK_DELTA16,
+    BLOCK_BWT | BLOCK_MTF,
+    BLOCK_BWT | BLOCK_MTF | BLOCK_RLE,
+};
+
+int bwt_encode(const uint8_t *in, uint64_t len, uint8_t *out, uint64_t *primary)
+{
+  uint32_t n = (uint32_t)len;
+  *primary = 0;
+  if (len == 0)
+    return 0;
+  if (len >= UINT32_MAX)
+    return -1;
+
+  uint32_t *sa = (uint32_t *)malloc(n * sizeof(uint32_t));
+  uint32_t *rank = (uint32_t *)malloc(n * sizeof(uint32_t));
+  uint32_t *tmp = (uint32_t *)malloc(n * sizeof(uint32_t));
+  uint32_t *count = (uint32_t *)malloc((n > 256 ? n : 256) * sizeof(uint32_t) + sizeof(uint32_t));
+  if (mem_check(sa, "sa") || mem_check(rank, "rank") || mem_check(tmp, "tmp") || mem_check(count, "count"))
+    return -1;
+
+  // Order the rotations by their first octet
+  memset(count, 0, 257 * sizeof(uint32_t));
+  for (uint32_t i = 0; i < n; i++)
+    count[in[i] + 1]++;
+  for (unsigned c = 0; c < 256; c++)
+    count[c + 1] += count[c];
+  for (uint32_t i = 0; i < n; i++)
+    sa[count[in[i]]++] = i;
+
+  uint32_t classes = 1;
+  rank[sa[0]] = 0;
+  for (uint32_t j = 1; j < n; j++)
+  {
+    if (in[sa[j]] != in[sa[j - 1]])
+      classes++;
+    rank[sa[j]] = classes - 1;
+  }
+
+  // Prefix doubling: order by the first 2k octets from the order by the first k octets
+  for (uint32_t k = 1; k < n && classes < n; k <<= 1)
+  {
+    // Already ordered by the second half, so a stable sort by the first half finishes it
+    for (uint32_t j = 0; j < n; j++)
+      tmp[j] = (sa[j] >= k) ? sa[j] - k : sa[j] + n - k;
+
+    memset(count, 0, (classes + 1) * sizeof(uint32_t));
+    for (uint32_t j = 0; j < n; j++)
+      count[rank[tmp[j]] + 1]++;
+    for (uint32_t c = 0; c < classes; c++)
+      count[c + 1] += count[c];
+    for (uint32_t j = 0; j < n; j++)
+      sa[count[rank[tmp[j]]]++] = tmp[j];
+
+    // Rotations stay in one class while both halves match
+    tmp[sa[0]] = 0;
+    classes = 1;
+    for (uint32_t j = 1; j < n; j++)
+    {
+      uint32_t cur = sa[j], prev = sa[j - 1];
+      uint32_t cur_k = (cur + k < n) ? cur + k : cur + k - n;
+      uint32_t prev_k = (prev + k < n) ? prev + k : prev + k - n;
+      if (rank[cur] != rank[prev] || rank[cur_k] != rank[prev_k])
+        classes++;
+      tmp[cur] = classes - 1;
+    }
+
+    uint32_t *swap = rank;
+    rank = tmp;
+    tmp = swap;
+  }
+
+  // The last column, and the row of the original
+  for (uint32_t j = 0; j < n; j++)
+  {
+    out[j] = in[(sa[j] + n - 1) % n];
+    if (sa[j] == 0)
+      *primary = j;
+  }
+
+  free(sa);
+  free(rank);
+  free(tmp);
+  free(count);
+  return 0;
+}
+
+int bwt_decode(const uint8_t *in, uint64_t len, uint64_t primary, uint8_t *out)
+{
+  uint64_t first[256] = {0};
+  uint64_t seen[256] = {0};
+
+  if (len == 0)
+    return 0;
+  if (primary >= len || len >= UINT32_MAX)
+    return -1;
+
+  uint32_t *lf = (uint32_t *)malloc(len * sizeof(uint32_t));
+  if (mem_check(lf, "lf"))
+    return -1;
+
+  // Row of the first column for each octet of the last column
+  for (uint64_t i = 0; i < len; i++)
+    first[in[i]]++;
+  for (unsigned c = 0, sum = 0; c < 256; c++)
+  {
+    uint64_t num = first[c];
+    first[c] = sum;
+    sum += num;
+  }
+  for (uint64_t i = 0; i < len; i++)
+    lf[i] = (uint32_t)(first[in[i]] + seen[in[i]]++);
+
+  // Walk backward from the row of the original
+  uint64_t row = primary;
+  for (uint64_t k = len; k > 0; k--)
+  {
+    out[k - 1] = in[row];
+    row = lf[row];
+  }
+
+  free(lf);
+  return 0;
+}
+
+void mtf_encode(uint8_t *data, uint64_t len)
+{
+  uint8_t list[256];
+  for (unsigned c = 0; c < 256; c++)
+    list[c] = (uint8_t)c;
+
+  for (uint64_t i = 0; i < len; i++)
+  {
+    uint8_t c = data[i];
+    uint8_t j = 0;
+    while (list[j] != c)
+      j++;
+
+    memmove(list + 1, list, j);
+    list[0] = c;
+    data[i] = j;
+  }
+}
+
+void mtf_decode(uint8_t *data, uint64_t len)
+{
+  uint8_t list[256];
+  for (unsigned c = 0; c < 256; c++)
+    list[c] = (uint8_t)c;
+
+  for (uint64_t i = 0; i < len; i++)
+  {
+    uint8_t j = data[i];
+    uint8_t c = list[j];
+
+    memmove(list + 1, list, j);
+    list[0] = c;
+    data[i] = c;
+  }
+}
+
+uint64_t rle_encode(const uint8_t *in, uint64_t len, uint8_t *out)
+{
+  uint64_t pos = 0;
+  for (uint64_t i = 0; i < len;)
+  {
+    if (in[i])
+    {
+      out[pos++] = in[i++];
+      continue;
+    }
+
+    // Up to 256 zeros per pair
+    uint64_t run = 1;
+    while (i + run < len && !in[i + run] && run < 256)
+      run++;
+    out[pos++] = 0x00;
+    out[pos++] = (uint8_t)(run - 1);
+    i += run;
+  }
+  return pos;
+}
+
+int rle_decode(const uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t len)
+{
+  uint64_t pos = 0;
+  for (uint64_t i = 0; i < in_len; i++)
+  {
+    if (in[i])
+    {
+      if (pos == len)
+        return -1;
+      out[pos++] = in[i];
+      continue;
+    }
+
+    if (++i == in_len || pos + in[i] + 1 > len)
+      return -1;
+    memset(out + pos, 0x00, in[i] + 1);
+    pos += in[i] + 1;
+  }
+  return (pos == len) ? 0 : -1;
+}
+
+// Read a little-endian word of `width` octets
+static uint16_t get_word(const uint8_t *p, uint8_t width)
+{
+  return (width == 1) ? p[0] : (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// Write a little-endian word of `width` octets
+static void put_word(uint8_t *p, uint16_t word, uint8_t width)
+{
+  p[0] = (uint8_t)word;
+  if (width == 2)
+    p[1] = (uint8_t)(word >> 8);
+}
+
+void delta_encode(uint8_t *data, uint64_t len, uint8_t width)
+{
+  // Walk backward so that each word still sees its original predecessor; a trailing odd octet is kept
+  for (uint64_t i = len / width; i > 1; i--)
+  {
+    uint8_t *cur = data + (i - 1) * width;
+    put_word(cur, get_word(cur, width) - get_word(cur - width, width), width);
+  }
+}
+
+void delta_decode(uint8_t *data, uint64_t len, uint8_t width)
+{
+  for (uint64_t i = 1; i < len / width; i++)
+  {
+    uint8_t *cur = data + i * width;
+    put_word(cur, get_word(cur, width) + get_word(cur - width, width), width);
+  }
+}
+
+/* ******************************************** */
+
+uint8_t *apply_transforms(uint8_t flags, const uint8_t *in, uint64_t len, uint64_t *out_len, uint64_t *primary)
+{
+  // Zero-run RLE may double the length
+  uint8_t *cur = (uint8_t *)malloc(2 * len + 1);
+  uint8_t *other = (uint8_t *)malloc(2 * len + 1);
+  if (mem_check(cur, "cur") || mem_check(other, "other"))
+    return NULL;
+
+  memcpy(cur, in, len);
+  *out_len = len;
+  *primary = 0;
+
+  if (flags & BLOCK_DELTA)
+    delta_encode(cur, len, 1);
+  if (flags & BLOCK_DELTA16)
+    delta_encode(cur, len, 2);
+
+  if (flags & BLOCK_BWT)
+  {
+    if (bwt_encode(cur, len, other, primary))
+      goto failed;
+    uint8_t *swap = cur;
+    cur = other;
+    other = swap;
+  }
+
+  if (flags & BLOCK_MTF)
+    mtf_encode(cur, len);
+
+  if (flags & BLOCK_RLE)
+  {
+    *out_len = rle_encode(cur, len, other);
+    uint8_t *swap = cur;
+    cur = other;
+    other = swap;
+  }
+
+  free(other);
+  return cur;
+
+failed:
+  free(cur);
+  free(other);
+  return NULL;
+}
+
+int invert_transforms(uint8_t flags, const uint8_t *in, uint64_t in_len, uint64_t primary, uint8_t *out, uint64_t len)
+{
+  // Every transform but the RLE keeps the length
+  if (!(flags & BLOCK_RLE) && in_len != len)
+    return -1;
+
+  uint8_t *tmp = (uint8_t *)malloc(len + 1);
+  if (mem_check(tmp, "tmp"))
+    return -1;
+
+  // Work in `tmp`, and end in `out`
+  if (flags & BLOCK_RLE)
+  {
+    if (rle_decode(in, in_len, tmp, len))
+      goto failed;
+  }
+  else
+    memcpy(tmp, in, len);
+
+  if (flags & BLOCK_MTF)
+    mtf_decode(tmp, len);
+
+  if (flags & BLOCK_BWT)
+  {
+    if (bwt_decode(tmp, len, primary, out))
+      goto failed;
+  }
+  else
+    memcpy(out, tmp, len);
+
+  if (flags & BLOCK_DELTA16)
+    delta_decode(out, len, 2);
+  if (flags & BLOCK_DELTA)
+    delta_decode(out, len, 1);
+
+  free(tmp);
+  return 0;
+
+failed:
+  free(tmp);
+  return -1;
+}
+
+int choose_transforms(TransformTask *task)
+{
+  size_t freqs[256];
+  double best = -1.0;
+
+  task->flags = 0;
+  task->out = NULL;
+  task->out_len = task->len;
+  task->primary = 0;
+
+  for (size_t i = 0; i < sizeof(candidates); i++)
+  {
+    uint8_t *out = NULL;
+    uint64_t out_len = task->len, primary = 0;
+    if (candidates[i])
+    {
+      out = apply_transforms(candidates[i], task->in, task->len, &out_len, &primary);
+      if (!out)
+        return -1;
+    }
+
+    // Transformed blocks also store their coded length and BWT row
+    count_symbols(freqs, out ? out : task->in, out_len);
+    double cost = hist_cost(freqs, out_len) + (candidates[i] ? 8.0 * 2 * sizeof(uint64_t) : 0.0);
+    if (best >= 0.0 && cost >= best)
+    {
+      free(out);
+      continue;
+    }
+
+    free(task->out);
+    best = cost;
+    task->flags = candidates[i];
+    task->out = out;
+    task->out_len = out_len;
+    task->primary = primary;
+  }
+  return 0;
+}
+
+// Tasks shared by the threads of `transform_blocks()`
+typedef struct transform_job_t
+{
+  TransformTask *tasks;
+  uint64_t num_tasks;
+  uint64_t next; // first task not taken yet
+  int failed;
+  pthread_mutex_t lock;
+} TransformJob;
+
+static void transform_worker(void *arg, int id)
+{
+  TransformJob *job = (TransformJob *)arg;
+  (void)id;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&job->lock);
+    uint64_t idx = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (idx >= job->num_tasks)
+      break;
+
+    TransformTask *task = &job->tasks[idx];
+    int failed = 0;
+    if (task->choose)
+      failed = choose_transforms(task);
+    else
+    {
+      task->out = apply_transforms(task->flags, task->in, task->len, &task->out_len, &task->primary);
+      failed = !task->out;
+    }
+    if (failed)
+    {
+      pthread_mutex_lock(&job->lock);
+      job->failed = -1;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+}
+
+int transform_blocks(TransformTask *tasks, uint64_t num_tasks, int num_threads)
+{
+  TransformJob job = {.tasks = tasks, .num_tasks = num_tasks, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+  if (num_threads < 1)
+    num_threads = 1;
+  if ((uint64_t)num_threads > num_tasks)
+    num_threads = (int)num_tasks;
+
+  run_pool(transform_worker, &job, num_threads);
+  pthread_mutex_destroy(&job.lock);
+  return job.failed;
+}
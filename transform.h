@@ -0,0 +1,68 @@
+#pragma once
+#ifndef __TRANSFORM_H__
+#define __TRANSFORM_H__
+
+#include "huffman.h"
+
+/*
+ * Transforms applied to a block before the histogram, in this order:
+ * delta (BLOCK_DELTA or BLOCK_DELTA16), BWT, move-to-front, zero-run RLE.
+ * The decoder inverts them in the reverse order.
+ */
+
+/* ******************************************** */
+
+// Longest block given to the BWT unless the block size is set, as it needs about 20 times the block in memory
+#define BWT_BLOCK_SIZE ((uint64_t)1 << 20)
+
+// Burrows-Wheeler transform of the rotations of `in`, and the row of the original
+int bwt_encode(const uint8_t *in, uint64_t len, uint8_t *out, uint64_t *primary);
+
+// Inverse of `bwt_encode()`
+int bwt_decode(const uint8_t *in, uint64_t len, uint64_t primary, uint8_t *out);
+
+// Move-to-front, in place
+void mtf_encode(uint8_t *data, uint64_t len);
+
+// Inverse of `mtf_encode()`, in place
+void mtf_decode(uint8_t *data, uint64_t len);
+
+// Replace runs of zeros with a zero and the run length, and return the written length (at most `2 * len`)
+uint64_t rle_encode(const uint8_t *in, uint64_t len, uint8_t *out);
+
+// Inverse of `rle_encode()`, expanding into exactly `len` octets
+int rle_decode(const uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t len);
+
+// Difference of each `width`-octet little-endian word from the previous one, in place
+void delta_encode(uint8_t *data, uint64_t len, uint8_t width);
+
+// Inverse of `delta_encode()`, in place
+void delta_decode(uint8_t *data, uint64_t len, uint8_t width);
+
+/* ******************************************** */
+
+// Apply the transforms of `flags`, and return the transformed block (freed by the caller)
+uint8_t *apply_transforms(uint8_t flags, const uint8_t *in, uint64_t len, uint64_t *out_len, uint64_t *primary);
+
+// Invert the transforms of `flags` into the `len` original octets
+int invert_transforms(uint8_t flags, const uint8_t *in, uint64_t in_len, uint64_t primary, uint8_t *out, uint64_t len);
+
+// A block transformed by `transform_blocks()`
+typedef struct transform_task_t
+{
+  const uint8_t *in; // original octets
+  uint64_t len;      // original length
+  uint8_t flags;     // BLOCK_* transforms
+  bool choose;       // replace `flags` with the cheapest of the candidate transforms
+  uint8_t *out;      // transformed octets
+  uint64_t out_len;  // transformed length
+  uint64_t primary;  // row of the original in the BWT
+} TransformTask;
+
+// Apply the candidate transforms to the block of the task, and keep the one of the smallest estimated size
+int choose_transforms(TransformTask *task);
+
+// Transform independent blocks on up to `num_threads` threads
+int transform_blocks(TransformTask *tasks, uint64_t num_tasks, int num_threads);
+
+#endif // __TRANSFORM_H__
@@ -0,0 +1,319 @@
+#include "tune.h"
+#include "transform.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Candidate block sizes, in octets
+static const uint64_t block_sizes[] = {16 << 10, 64 << 10, 256 << 10};
+
+// Candidate widths of the decoder lookup table (0 walks the tree)
+static const uint8_t table_widths[] = {0, 8, 10, LUT_MAX_BITS};
+
+// Smallest block of the thread benchmark
+#define THREAD_BLOCK_MIN (4 << 10)
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* ******************************************** */
+
+// Blocks of the sample shared by the threads of `run_bench()`
+typedef struct bench_job_t
+{
+  const uint8_t *sample;
+  uint64_t len;
+  uint64_t block_size;
+  uint8_t transforms;
+  uint8_t table_bits;
+  uint64_t next; // first block not taken yet
+  uint64_t size; // total encoded size
+  int failed;
+  pthread_mutex_t lock;
+} BenchJob;
+
+// Transform, encode, decode and invert a block the way an archive would
+static int bench_block(BenchJob *job, Workspace *ws, const uint8_t *msg, uint64_t len, Buffer *enc, Buffer *dec,
+                       uint64_t *size)
+{
+  uint64_t coded_len = len, primary = 0;
+  uint8_t *coded = (uint8_t *)msg;
+
+  if (job->transforms)
+  {
+    coded = apply_transforms(job->transforms, msg, len, &coded_len, &primary);
+    if (!coded)
+      return -1;
+  }
+
+  int failed = build_workspace(ws, coded, coded_len);
+  if (!failed && encoded_size(ws) > enc->capacity)
+    failed = -1;
+  if (!failed)
+  {
+    enc->len = encode_workspace(ws, coded, coded_len, enc->buffer, enc->capacity);
+    failed = !enc->len || decode_small(ws, enc->buffer, enc->len, dec->buffer, dec->capacity, &dec->len);
+  }
+  if (!failed && job->transforms)
+    failed = invert_transforms(job->transforms, dec->buffer, dec->len, primary, dec->buffer + coded_len, len);
+
+  if (job->transforms)
+    free(coded);
+  *size = enc->len;
+  return failed ? -1 : 0;
+}
+
+static void bench_worker(void *arg, int id)
+{
+  BenchJob *job = (BenchJob *)arg;
+  (void)id;
+
+  // Codes stay under 32 bits, and the inverse transforms need room past the coded block
+  Workspace *ws = (Workspace *)malloc(sizeof(Workspace));
+  Buffer *enc = new_buffer(2048 + 4 * (2 * job->block_size + 1));
+  Buffer *dec = new_buffer(4 * job->block_size + 2);
+  if (mem_check(ws, "ws") || mem_check(enc, "enc") || mem_check(dec, "dec"))
+  {
+    // The blocks left to this thread would not be timed, so the whole round is void
+    pthread_mutex_lock(&job->lock);
+    job->failed = -1;
+    pthread_mutex_unlock(&job->lock);
+    goto done;
+  }
+  ws->book_len = 0;
+  ws->lut_bits = job->table_bits;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&job->lock);
+    uint64_t pos = job->next;
+    job->next += job->block_size;
+    pthread_mutex_unlock(&job->lock);
+    if (pos >= job->len)
+      break;
+
+    uint64_t len = (job->len - pos < job->block_size) ? job->len - pos : job->block_size;
+    uint64_t size = 0;
+    int failed = bench_block(job, ws, job->sample + pos, len, enc, dec, &size);
+
+    pthread_mutex_lock(&job->lock);
+    job->size += size;
+    job->failed |= failed;
+    pthread_mutex_unlock(&job->lock);
+  }
+
+done:
+  free(ws);
+  del_buffer(enc);
+  del_buffer(dec);
+}
+
+// Time the round trip of the sample in blocks on `num_threads` threads, keeping the fastest round (negative on failure)
+static double run_bench(BenchJob *proto, int num_threads, uint64_t *size)
+{
+  double best = -1.0;
+
+  for (int round = 0; round < TUNE_ROUNDS; round++)
+  {
+    BenchJob job = *proto;
+    job.next = 0;
+    job.size = 0;
+    job.failed = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    double start = now();
+    run_pool(bench_worker, &job, num_threads);
+    double elapsed = now() - start;
+
+    pthread_mutex_destroy(&job.lock);
+    if (job.failed)
+      return -1.0;
+    if (best < 0 || elapsed < best)
+      best = elapsed;
+    *size = job.size;
+  }
+  return best;
+}
+
+/* ******************************************** */
+
+// Read the settings of the cache file, if it was written for this host and these transforms
+static int read_cache(const char *path, const ArchiveOpts *opts, long cores, Tuning *result)
+{
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  char key[64];
+  unsigned long long value;
+  long cached_cores = -1;
+  int transforms = -1, found = 0;
+  while (fscanf(fp, "%63s %llu", key, &value) == 2)
+  {
+    if (!strcmp(key, "cores"))
+      cached_cores = (long)value;
+    else if (!strcmp(key, "transforms"))
+      transforms = (int)value;
+    else if (!strcmp(key, "block_size"))
+    {
+      result->block_size = value;
+      found |= 0x01;
+    }
+    else if (!strcmp(key, "num_threads"))
+    {
+      result->num_threads = (int)value;
+      found |= 0x02;
+    }
+    else if (!strcmp(key, "table_bits"))
+    {
+      result->table_bits = (uint8_t)value;
+      found |= 0x04;
+    }
+  }
+  fclose(fp);
+
+  if (found != 0x07 || cached_cores != cores || transforms != opts->transforms || result->num_threads < 1 ||
+      result->table_bits > LUT_MAX_BITS)
+    return -1;
+  return 0;
+}
+
+static int write_cache(const char *path, const ArchiveOpts *opts, long cores, const Tuning *result)
+{
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+  {
+    fprintf(stderr, "[Error]\tFailed to write the tuning cache '%s'\n", path);
+    return -1;
+  }
+
+  fprintf(fp, "cores %ld\n", cores);
+  fprintf(fp, "transforms %u\n", opts->transforms);
+  fprintf(fp, "block_size %llu\n", (unsigned long long)result->block_size);
+  fprintf(fp, "num_threads %d\n", result->num_threads);
+  fprintf(fp, "table_bits %u\n", result->table_bits);
+  fclose(fp);
+  return 0;
+}
+
+// Gather evenly spread slices of the message, or return the message itself if it is short enough
+static const uint8_t *take_sample(const uint8_t *msg, uint64_t len, uint64_t *sample_len, uint8_t **owned)
+{
+  *owned = NULL;
+  if (len <= TUNE_SAMPLE)
+  {
+    *sample_len = len;
+    return msg;
+  }
+
+  uint8_t *sample = (uint8_t *)malloc(TUNE_SAMPLE);
+  if (mem_check(sample, "sample"))
+    return NULL;
+
+  uint64_t slice = TUNE_SAMPLE / TUNE_SLICES;
+  for (uint64_t i = 0; i < TUNE_SLICES; i++)
+    memcpy(sample + i * slice, msg + (len - slice) * i / (TUNE_SLICES - 1), slice);
+
+  *owned = sample;
+  *sample_len = slice * TUNE_SLICES;
+  return sample;
+}
+
+int auto_tune(const uint8_t *msg, uint64_t len, const char *cache_path, ArchiveOpts *opts, Tuning *result)
+{
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  memset(result, 0, sizeof(Tuning));
+
+  if (cores < 1)
+    cores = 1;
+
+  if (cache_path && !read_cache(cache_path, opts, cores, result))
+  {
+    result->cached = true;
+    goto apply;
+  }
+  if (!msg || !len)
+    return -1;
+
+  uint8_t *owned;
+  uint64_t sample_len;
+  const uint8_t *sample = take_sample(msg, len, &sample_len, &owned);
+  if (!sample)
+    return -1;
+
+  double start = now();
+  BenchJob job = {.sample = sample, .len = sample_len, .transforms = opts->transforms};
+  uint64_t best_size = UINT64_MAX;
+  uint64_t sizes[sizeof(block_sizes) / sizeof(block_sizes[0])];
+  double times[sizeof(block_sizes) / sizeof(block_sizes[0])][sizeof(table_widths)];
+
+  // Size and single-thread speed of every block size and table width
+  for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++)
+    for (size_t w = 0; w < sizeof(table_widths); w++)
+    {
+      job.block_size = block_sizes[b];
+      job.table_bits = table_widths[w];
+      times[b][w] = run_bench(&job, 1, &sizes[b]);
+      if (times[b][w] < 0)
+      {
+        free(owned);
+        return -1;
+      }
+      if (sizes[b] < best_size)
+        best_size = sizes[b];
+    }
+
+  // The fastest pair among the block sizes close enough to the smallest output
+  double best_time = -1.0;
+  for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++)
+  {
+    if ((double)sizes[b] > (double)best_size * (1.0 + TUNE_SIZE_SLACK))
+      continue;
+    for (size_t w = 0; w < sizeof(table_widths); w++)
+      if (best_time < 0 || times[b][w] < best_time)
+      {
+        best_time = times[b][w];
+        result->block_size = block_sizes[b];
+        result->table_bits = table_widths[w];
+      }
+  }
+
+  // Scaling of the host, on blocks small enough to keep every thread busy
+  job.table_bits = result->table_bits;
+  job.block_size = sample_len / (4 * (uint64_t)cores);
+  if (job.block_size < THREAD_BLOCK_MIN)
+    job.block_size = THREAD_BLOCK_MIN;
+
+  uint64_t size;
+  result->num_threads = 1;
+  best_time = run_bench(&job, 1, &size);
+  for (long k = 2; k < 2 * cores && best_time > 0; k *= 2)
+  {
+    // Powers of two, then all the cores
+    int n = (k > cores) ? (int)cores : (int)k;
+    double elapsed = run_bench(&job, n, &size);
+    if (elapsed > 0 && elapsed * TUNE_THREAD_GAIN < best_time)
+    {
+      best_time = elapsed;
+      result->num_threads = n;
+    }
+  }
+
+  result->seconds = now() - start;
+  free(owned);
+
+  if (cache_path)
+    write_cache(cache_path, opts, cores, result);
+
+apply:
+  if (opts->split == SPLIT_FIXED)
+    opts->block_size = result->block_size;
+  opts->num_threads = result->num_threads;
+  opts->table_bits = result->table_bits;
+  return 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#ifndef __TUNE_H__
+#define __TUNE_H__
+
+#include "huffman.h"
+
+/*
+ * Calibration of the archive settings for the host and the data.
+ * A sample of the input is encoded and decoded under a few candidate
+ * settings, and the fastest ones are kept. The result may be cached in
+ * a text file of `key value` lines, valid while the core count and the
+ * transforms stay the same.
+ */
+
+// Longest sample of the input the calibration runs on
+#define TUNE_SAMPLE ((uint64_t)512 << 10)
+
+// Number of slices the sample is taken from, evenly spread over the input
+#define TUNE_SLICES 16
+
+// Runs of each measurement, keeping the fastest
+#define TUNE_ROUNDS 2
+
+// Extra compressed size tolerated from a faster block size, relative to the smallest
+#define TUNE_SIZE_SLACK 0.01
+
+// Speedup more threads must bring to be preferred
+#define TUNE_THREAD_GAIN 1.1
+
+/* ******************************************** */
+
+// Settings picked by `auto_tune()`
+typedef struct tuning_t
+{
+  uint64_t block_size; // octets per block
+  int num_threads;     // threads transforming or decoding the blocks
+  uint8_t table_bits;  // width of the decoder lookup table
+  bool cached;         // read from the cache file instead of measured
+  double seconds;      // time spent calibrating
+} Tuning;
+
+// Pick the block size, thread count and decoder table width from a sample of the message, and store them into `opts`;
+// the cache file (if given) is read first and written after a calibration. Without a message only the cache is read.
+// The block size is kept for adaptive splits.
+int auto_tune(const uint8_t *msg, uint64_t len, const char *cache_path, ArchiveOpts *opts, Tuning *result);
+
+#endif // __TUNE_H__
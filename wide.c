@@ -0,0 +1,541 @@
+#include "wide.h"
+#include "transform.h"
+
+#include <math.h>
+
+// Word of a block, counted in the hash table of `wide_symbols()`
+typedef struct word_t
+{
+  uint64_t offset; // first occurrence in the block
+  uint64_t count;
+  uint32_t len;    // 0 for an empty slot
+  int32_t token;   // index in the dictionary (-1 if not kept)
+} Word;
+
+WideCoder *new_wide_coder(uint8_t lut_bits)
+{
+  WideCoder *wc = (WideCoder *)calloc(1, sizeof(WideCoder));
+  if (mem_check(wc, "wc"))
+    return NULL;
+
+  wc->freqs = (size_t *)calloc(WIDE_MAX_SYMBOLS, sizeof(size_t));
+  wc->lens = (uint8_t *)calloc(WIDE_MAX_SYMBOLS, sizeof(uint8_t));
+  wc->codes = (uint32_t *)calloc(WIDE_MAX_SYMBOLS, sizeof(uint32_t));
+  wc->sorted = (uint16_t *)calloc(WIDE_MAX_SYMBOLS, sizeof(uint16_t));
+  wc->token_at = (uint64_t *)calloc(DICT_MAX_TOKENS, sizeof(uint64_t));
+  if (mem_check(wc->freqs, "wc->freqs") || mem_check(wc->lens, "wc->lens") || mem_check(wc->codes, "wc->codes") ||
+      mem_check(wc->sorted, "wc->sorted") || mem_check(wc->token_at, "wc->token_at"))
+    return NULL;
+
+  wc->lut_bits = (lut_bits > LUT_MAX_BITS) ? LUT_MAX_BITS : lut_bits;
+  return wc;
+}
+
+void del_wide_coder(WideCoder *wc)
+{
+  if (!wc)
+    return;
+
+  free(wc->freqs);
+  free(wc->lens);
+  free(wc->codes);
+  free(wc->sorted);
+  free(wc->token_at);
+  free(wc->symbols);
+  free(wc->dict);
+  free(wc);
+}
+
+/* ******************************************** */
+
+// Make room for `num` symbols of the block
+static int reserve_symbols(WideCoder *wc, uint64_t num)
+{
+  if (num <= wc->capacity)
+    return 0;
+
+  uint16_t *symbols = (uint16_t *)realloc(wc->symbols, num * sizeof(uint16_t));
+  if (mem_check(symbols, "wc->symbols"))
+    return -1;
+
+  wc->symbols = symbols;
+  wc->capacity = num;
+  return 0;
+}
+
+static bool is_word(uint8_t c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// FNV-1a hash of a word
+static uint64_t hash_word(const uint8_t *p, uint32_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (uint32_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+// Slot of a word in the table of `mask + 1` slots, empty if it is not there
+static Word *find_word(Word *table, uint64_t mask, const uint8_t *msg, uint64_t offset, uint32_t len)
+{
+  for (uint64_t h = hash_word(msg + offset, len) & mask;; h = (h + 1) & mask)
+  {
+    Word *w = &table[h];
+    if (!w->len || (w->len == len && !memcmp(msg + w->offset, msg + offset, len)))
+      return w;
+  }
+}
+
+// Order the words by the octets their tokens save, then by their first occurrence
+static int cmp_savings(const void *a, const void *b)
+{
+  const Word *x = *(const Word *const *)a, *y = *(const Word *const *)b;
+  uint64_t sx = x->count * (x->len - 1), sy = y->count * (y->len - 1);
+  if (sx != sy)
+    return (sx < sy) ? 1 : -1;
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Pick the dictionary of a block, and turn it into octets and tokens
+static int tokenize(WideCoder *wc, const uint8_t *msg, uint64_t len, uint32_t num_tokens)
+{
+  uint64_t capacity = 1024, num_words = 0;
+  Word *table = (Word *)calloc(capacity, sizeof(Word));
+  if (mem_check(table, "table"))
+    return -1;
+
+  // Count the words, growing the table at half full
+  for (uint64_t i = 0; i < len;)
+  {
+    uint64_t start = i;
+    while (i < len && is_word(msg[i]))
+      i++;
+    if (i == start)
+    {
+      i++;
+      continue;
+    }
+
+    uint32_t word_len = (uint32_t)(i - start);
+    if (word_len < DICT_MIN_WORD || word_len > DICT_MAX_WORD)
+      continue;
+
+    Word *w = find_word(table, capacity - 1, msg, start, word_len);
+    if (w->len)
+    {
+      w->count++;
+      continue;
+    }
+    *w = (Word){.offset = start, .count = 1, .len = word_len, .token = -1};
+
+    if (++num_words * 2 > capacity)
+    {
+      Word *grown = (Word *)calloc(2 * capacity, sizeof(Word));
+      if (mem_check(grown, "grown"))
+        return -1;
+      for (uint64_t k = 0; k < capacity; k++)
+        if (table[k].len)
+          *find_word(grown, 2 * capacity - 1, msg, table[k].offset, table[k].len) = table[k];
+      free(table);
+      table = grown;
+      capacity *= 2;
+    }
+  }
+
+  // Keep the repeated words that save the most
+  Word **ranked = (Word **)malloc((num_words + 1) * sizeof(Word *));
+  if (mem_check(ranked, "ranked"))
+    return -1;
+  uint64_t num_ranked = 0;
+  for (uint64_t k = 0; k < capacity; k++)
+    if (table[k].len && table[k].count > 1)
+      ranked[num_ranked++] = &table[k];
+  qsort(ranked, num_ranked, sizeof(Word *), cmp_savings);
+  if (num_ranked > num_tokens)
+    num_ranked = num_tokens;
+
+  wc->num_tokens = (uint32_t)num_ranked;
+  wc->dict_len = sizeof(uint32_t);
+  for (uint64_t t = 0; t < num_ranked; t++)
+    wc->dict_len += 1 + ranked[t]->len;
+
+  free(wc->dict);
+  wc->dict = (uint8_t *)malloc(wc->dict_len);
+  if (mem_check(wc->dict, "wc->dict"))
+    return -1;
+
+  uint8_t *p = wc->dict;
+  memcpy(p, &wc->num_tokens, sizeof(uint32_t));
+  p += sizeof(uint32_t);
+  for (uint64_t t = 0; t < num_ranked; t++)
+  {
+    ranked[t]->token = (int32_t)t;
+    *p++ = (uint8_t)ranked[t]->len;
+    memcpy(p, msg + ranked[t]->offset, ranked[t]->len);
+    p += ranked[t]->len;
+  }
+
+  // Replace the kept words by their tokens
+  uint64_t n = 0;
+  for (uint64_t i = 0; i < len;)
+  {
+    uint64_t start = i;
+    while (i < len && is_word(msg[i]))
+      i++;
+    if (i == start)
+    {
+      wc->symbols[n++] = msg[i++];
+      continue;
+    }
+
+    uint32_t word_len = (uint32_t)(i - start);
+    if (word_len >= DICT_MIN_WORD && word_len <= DICT_MAX_WORD)
+    {
+      Word *w = find_word(table, capacity - 1, msg, start, word_len);
+      if (w->token >= 0)
+      {
+        wc->symbols[n++] = (uint16_t)(256 + w->token);
+        continue;
+      }
+    }
+    for (uint64_t k = start; k < i; k++)
+      wc->symbols[n++] = msg[k];
+  }
+
+  wc->num_coded = n;
+  wc->num_symbols = 256 + wc->num_tokens;
+  free(ranked);
+  free(table);
+  return 0;
+}
+
+int wide_symbols(WideCoder *wc, uint8_t flags, const uint8_t *msg, uint64_t len, uint32_t num_tokens)
+{
+  if (reserve_symbols(wc, len + 1))
+    return -1;
+
+  if (flags & BLOCK_WORDS)
+    return tokenize(wc, msg, len, (num_tokens > DICT_MAX_TOKENS) ? DICT_MAX_TOKENS : num_tokens);
+
+  // Little-endian words, and the last octet alone
+  for (uint64_t i = 0; i < len / 2; i++)
+    wc->symbols[i] = (uint16_t)(msg[2 * i] | (msg[2 * i + 1] << 8));
+  wc->num_coded = len / 2;
+  if (len & 0x01)
+    wc->symbols[wc->num_coded++] = msg[len - 1];
+
+  wc->num_tokens = 0;
+  wc->num_symbols = WIDE_MAX_SYMBOLS;
+  return 0;
+}
+
+/* ******************************************** */
+
+// Canonical codes of the code lengths in `wc->lens`, and the tables of the decoder
+static int assign_canonical(WideCoder *wc)
+{
+  if (canonical_codes(wc->lens, wc->num_symbols, wc->codes, wc->count, wc->first))
+    return -1;
+
+  // Position of the first code of each length in `sorted`
+  wc->num_used = 0;
+  for (uint8_t k = 1; k <= MAX_CODE_BITS; k++)
+  {
+    wc->index[k] = wc->num_used;
+    wc->num_used += wc->count[k];
+  }
+
+  for (uint32_t s = 0; s < wc->num_symbols; s++)
+  {
+    uint8_t k = wc->lens[s];
+    if (k)
+      wc->sorted[wc->index[k] + (wc->codes[s] - wc->first[k])] = (uint16_t)s;
+  }
+
+  // Short codes fill every entry of the table that starts with them
+  memset(wc->lut, 0, sizeof(wc->lut));
+  for (uint32_t s = 0; s < wc->num_symbols && wc->lut_bits; s++)
+  {
+    uint8_t k = wc->lens[s];
+    if (!k || k > wc->lut_bits)
+      continue;
+    uint32_t from = wc->codes[s] << (wc->lut_bits - k);
+    for (uint32_t v = from; v < from + ((uint32_t)1 << (wc->lut_bits - k)); v++)
+      wc->lut[v] = (s << 8) | k;
+  }
+  return 0;
+}
+
+int wide_build(WideCoder *wc)
+{
+  memset(wc->freqs, 0, wc->num_symbols * sizeof(size_t));
+  for (uint64_t i = 0; i < wc->num_coded; i++)
+    wc->freqs[wc->symbols[i]]++;
+
+  CodeLeaf *leaves = (CodeLeaf *)malloc(wc->num_symbols * sizeof(CodeLeaf));
+  size_t *weights = (size_t *)malloc(2 * wc->num_symbols * sizeof(size_t));
+  uint32_t *parents = (uint32_t *)malloc(2 * wc->num_symbols * sizeof(uint32_t));
+  if (mem_check(leaves, "leaves") || mem_check(weights, "weights") || mem_check(parents, "parents"))
+    return -1;
+
+  code_lengths(wc->freqs, wc->num_symbols, wc->lens, leaves, weights, parents);
+  free(leaves);
+  free(weights);
+  free(parents);
+
+  if (assign_canonical(wc))
+    return -1;
+
+  wc->total_bits = 0;
+  for (uint32_t s = 0; s < wc->num_symbols; s++)
+    wc->total_bits += wc->freqs[s] * wc->lens[s];
+  return 0;
+}
+
+/* ******************************************** */
+
+uint64_t wide_book_size(WideCoder *wc, uint8_t flags)
+{
+  uint64_t size = sizeof(uint32_t) + 1;
+
+  if (wc->num_symbols < 3 * wc->num_used)
+    size += wc->num_symbols;
+  else
+    size += sizeof(uint32_t) + 3 * (uint64_t)wc->num_used;
+
+  if (flags & BLOCK_WORDS)
+    size += wc->dict_len;
+  return size;
+}
+
+uint8_t *wide_write_book(WideCoder *wc, uint8_t flags, uint8_t *p)
+{
+  memcpy(p, &wc->num_symbols, sizeof(uint32_t));
+  p += sizeof(uint32_t);
+
+  if (wc->num_symbols < 3 * wc->num_used)
+  {
+    *p++ = WIDE_DENSE;
+    memcpy(p, wc->lens, wc->num_symbols);
+    p += wc->num_symbols;
+  }
+  else
+  {
+    *p++ = WIDE_SPARSE;
+    memcpy(p, &wc->num_used, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    for (uint32_t s = 0; s < wc->num_symbols; s++)
+      if (wc->lens[s])
+      {
+        *p++ = (uint8_t)s;
+        *p++ = (uint8_t)(s >> 8);
+        *p++ = wc->lens[s];
+      }
+  }
+
+  if (flags & BLOCK_WORDS)
+  {
+    memcpy(p, wc->dict, wc->dict_len);
+    p += wc->dict_len;
+  }
+  return p;
+}
+
+void wide_pack(WideCoder *wc, uint8_t *data)
+{
+  BitPacker bp = {.p = data};
+  for (uint64_t i = 0; i < wc->num_coded; i++)
+    put_code(&bp, wc->codes[wc->symbols[i]], wc->lens[wc->symbols[i]]);
+  flush_codes(&bp);
+}
+
+int wide_load_book(WideCoder *wc, uint8_t flags, const uint8_t *book, uint64_t size)
+{
+  uint64_t pos = sizeof(uint32_t) + 1;
+  if (size < pos)
+    return -1;
+
+  memcpy(&wc->num_symbols, book, sizeof(uint32_t));
+  if (!wc->num_symbols || wc->num_symbols > WIDE_MAX_SYMBOLS)
+    return -1;
+  memset(wc->lens, 0, wc->num_symbols);
+
+  if (book[sizeof(uint32_t)] == WIDE_DENSE)
+  {
+    if (pos + wc->num_symbols > size)
+      return -1;
+    memcpy(wc->lens, book + pos, wc->num_symbols);
+    pos += wc->num_symbols;
+  }
+  else if (book[sizeof(uint32_t)] == WIDE_SPARSE)
+  {
+    uint32_t num_used;
+    if (pos + sizeof(uint32_t) > size)
+      return -1;
+    memcpy(&num_used, book + pos, sizeof(uint32_t));
+    pos += sizeof(uint32_t);
+    if (num_used > wc->num_symbols || pos + 3 * (uint64_t)num_used > size)
+      return -1;
+
+    for (uint32_t i = 0; i < num_used; i++, pos += 3)
+    {
+      uint32_t s = book[pos] | (book[pos + 1] << 8);
+      if (s >= wc->num_symbols)
+        return -1;
+      wc->lens[s] = book[pos + 2];
+    }
+  }
+  else
+    return -1;
+
+  if (assign_canonical(wc))
+    return -1;
+
+  // Offsets of the tokens
+  wc->num_tokens = 0;
+  if (flags & BLOCK_WORDS)
+  {
+    if (pos + sizeof(uint32_t) > size)
+      return -1;
+    memcpy(&wc->num_tokens, book + pos, sizeof(uint32_t));
+    if (wc->num_tokens > DICT_MAX_TOKENS || wc->num_symbols > 256 + wc->num_tokens)
+      return -1;
+
+    free(wc->dict);
+    wc->dict_len = size - pos;
+    wc->dict = (uint8_t *)malloc(wc->dict_len);
+    if (mem_check(wc->dict, "wc->dict"))
+      return -1;
+    memcpy(wc->dict, book + pos, wc->dict_len);
+
+    uint64_t at = sizeof(uint32_t);
+    for (uint32_t t = 0; t < wc->num_tokens; t++)
+    {
+      if (at >= wc->dict_len || at + 1 + wc->dict[at] > wc->dict_len)
+        return -1;
+      wc->token_at[t] = at;
+      at += 1 + wc->dict[at];
+    }
+  }
+  return 0;
+}
+
+int wide_unpack(WideCoder *wc, uint8_t flags, const uint8_t *data, uint64_t num_bits, uint8_t *out, uint64_t len)
+{
+  uint64_t acc = 0; // pending bits, the next one first
+  unsigned have = 0;
+  uint64_t i = 0, pos = 0, count = 0;
+  uint64_t data_len = (num_bits + 7) / 8;
+
+  while (pos < num_bits)
+  {
+    while (have <= 56 && i < data_len)
+    {
+      acc |= (uint64_t)data[i++] << (56 - have);
+      have += 8;
+    }
+
+    // Short codes through the table, longer ones by the first code of each length
+    uint32_t s, k = 0;
+    uint32_t entry = wc->lut_bits ? wc->lut[acc >> (64 - wc->lut_bits)] : 0;
+    if (entry)
+    {
+      s = entry >> 8;
+      k = entry & 0xFF;
+    }
+    else
+    {
+      for (k = wc->lut_bits + 1; k <= MAX_CODE_BITS; k++)
+      {
+        uint64_t code = acc >> (64 - k);
+        if (code - wc->first[k] < wc->count[k])
+          break;
+      }
+      if (k > MAX_CODE_BITS)
+        return -1;
+      s = wc->sorted[wc->index[k] + ((acc >> (64 - k)) - wc->first[k])];
+    }
+
+    if (k > have || pos + k > num_bits)
+      return -1;
+    acc <<= k;
+    have -= k;
+    pos += k;
+
+    // Octets of the symbol
+    if (flags & BLOCK_WORDS)
+    {
+      if (s < 256)
+      {
+        if (count == len)
+          return -1;
+        out[count++] = (uint8_t)s;
+        continue;
+      }
+      if (s - 256 >= wc->num_tokens)
+        return -1;
+      const uint8_t *token = wc->dict + wc->token_at[s - 256];
+      if (count + token[0] > len)
+        return -1;
+      memcpy(out + count, token + 1, token[0]);
+      count += token[0];
+    }
+    else
+    {
+      if (count == len)
+        return -1;
+      out[count++] = (uint8_t)s;
+      if (count < len)
+        out[count++] = (uint8_t)(s >> 8);
+    }
+  }
+  return (count == len) ? 0 : -1;
+}
+
+/* ******************************************** */
+
+int analyze_wide(WideCoder *wc, uint8_t flags, const uint8_t *msg, uint64_t len, const ArchiveOpts *opts,
+                 Analysis *stats)
+{
+  const uint8_t *coded = msg;
+  uint8_t *transformed = NULL;
+  uint64_t coded_len = len, primary;
+
+  if (opts->transforms)
+  {
+    transformed = apply_transforms(opts->transforms, msg, len, &coded_len, &primary);
+    if (!transformed)
+      return -1;
+    coded = transformed;
+  }
+
+  if (wide_symbols(wc, flags, coded, coded_len, opts->num_tokens) || wide_build(wc))
+  {
+    free(transformed);
+    return -1;
+  }
+
+  // Shannon entropy of the histogram, spread over the octets
+  stats->entropy = 0.0;
+  for (uint32_t s = 0; s < wc->num_symbols; s++)
+    if (wc->freqs[s])
+    {
+      double p = (double)wc->freqs[s] / (double)wc->num_coded;
+      stats->entropy -= p * log2(p);
+    }
+  if (len)
+    stats->entropy *= (double)wc->num_coded / (double)len;
+
+  stats->len = len;
+  stats->total_bits = wc->total_bits;
+  stats->header_bytes = 1 + 2 * sizeof(uint64_t) + sizeof(uint64_t) + wide_book_size(wc, flags);
+  if (opts->transforms)
+    stats->header_bytes += 2 * sizeof(uint64_t);
+  stats->payload_bytes = (wc->total_bits + 7) / 8;
+  stats->fresh_book = true;
+
+  free(transformed);
+  return 0;
+}
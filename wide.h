@@ -0,0 +1,104 @@
+#pragma once
+#ifndef __WIDE_H__
+#define __WIDE_H__
+
+#include "huffman.h"
+
+/*
+ * Coder of the alphabets wider than an octet, for the blocks flagged
+ * BLOCK_SYM16 (little-endian 16-bit words, the last octet alone if odd)
+ * or BLOCK_WORDS (octets, and tokens of a dictionary of frequent words).
+ *
+ * Codes are canonical, so the codebook only holds the code lengths:
+ * the alphabet size (4 octets) and the layout (1 octet), then either
+ * the number of used symbols (4 octets) and a symbol (2 octets) and
+ * length (1 octet) for each (WIDE_SPARSE), or a length for every symbol
+ * of the alphabet (WIDE_DENSE). Word blocks follow with the dictionary:
+ * the number of tokens (4 octets), then a length octet and the octets
+ * of each token. Symbols below 256 are octets, and 256 + i is token i.
+ */
+
+// Largest alphabet of the wide coder
+#define WIDE_MAX_SYMBOLS 65536
+
+// Layouts of the codebook
+#define WIDE_SPARSE 0 // symbols and lengths of the used symbols
+#define WIDE_DENSE 1  // lengths of all the symbols
+
+// Default number of tokens of a dictionary
+#define DICT_TOKENS 4096
+
+// Largest number of tokens of a dictionary
+#define DICT_MAX_TOKENS (WIDE_MAX_SYMBOLS - 256)
+
+// Shortest and longest words kept as tokens
+#define DICT_MIN_WORD 2
+#define DICT_MAX_WORD 255
+
+/* ******************************************** */
+
+// Tables of the wide coder, allocated once and reused across blocks
+typedef struct wide_coder_t
+{
+  uint32_t num_symbols; // size of the alphabet of the block
+  size_t *freqs;        // occurrences of each symbol
+  uint8_t *lens;        // code length of each symbol (0 if unused)
+  uint32_t *codes;      // canonical code of each symbol
+  uint64_t total_bits;  // length of the encoded block in bits
+
+  // Symbols of the block being encoded
+  uint16_t *symbols;
+  uint64_t num_coded;
+  uint64_t capacity;
+
+  // Canonical decoder: the used symbols in the order of their codes, and per length,
+  // the number of codes, the first code and its position in `sorted`
+  uint16_t *sorted;
+  uint32_t num_used;
+  uint32_t count[MAX_CODE_BITS + 1];
+  uint64_t first[MAX_CODE_BITS + 1];
+  uint32_t index[MAX_CODE_BITS + 1];
+
+  // Symbol and length of the codes up to `lut_bits` long, indexed by the next bits (0 for longer codes)
+  uint8_t lut_bits;
+  uint32_t lut[1 << LUT_MAX_BITS];
+
+  // Dictionary of word blocks, in its codebook layout, and the offset of each token in it
+  uint32_t num_tokens;
+  uint8_t *dict;
+  uint64_t dict_len;
+  uint64_t *token_at;
+} WideCoder;
+
+// Allocate a wide coder, decoding `lut_bits` bits at a time
+WideCoder *new_wide_coder(uint8_t lut_bits);
+
+// Free the wide coder
+void del_wide_coder(WideCoder *wc);
+
+// Turn a block into the symbols of the alphabet of `flags`, with up to `num_tokens` dictionary tokens
+int wide_symbols(WideCoder *wc, uint8_t flags, const uint8_t *msg, uint64_t len, uint32_t num_tokens);
+
+// Build the canonical codes of the symbols of the block
+int wide_build(WideCoder *wc);
+
+// Size of the codebook section of the block, with its dictionary
+uint64_t wide_book_size(WideCoder *wc, uint8_t flags);
+
+// Write the codebook section, and return the end of it
+uint8_t *wide_write_book(WideCoder *wc, uint8_t flags, uint8_t *p);
+
+// Write the codes of the symbols of the block into `data` of `(total_bits + 7) / 8` octets
+void wide_pack(WideCoder *wc, uint8_t *data);
+
+// Load the codebook section of a block for decoding
+int wide_load_book(WideCoder *wc, uint8_t flags, const uint8_t *book, uint64_t size);
+
+// Decode `num_bits` bits into exactly `len` octets
+int wide_unpack(WideCoder *wc, uint8_t flags, const uint8_t *data, uint64_t num_bits, uint8_t *out, uint64_t len);
+
+// Predict the compressed size of a block coded with a wide alphabet; the entropy is in bits per octet
+int analyze_wide(WideCoder *wc, uint8_t flags, const uint8_t *msg, uint64_t len, const ArchiveOpts *opts,
+                 Analysis *stats);
+
+#endif // __WIDE_H__